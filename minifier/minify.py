@@ -202,7 +202,17 @@ def get_args():
 
 
 def get_source(path: str) -> str:
-    return open(path, "r").read()
+    return insert_lines(open(path, "r").read())
+
+
+# // minify insert [code] lines hold code that only the minified build gets
+def insert_lines(src: str) -> str:
+    return re.sub(r"^([ \t]*)// minify insert (.*)$", r"\1\2", src, flags=re.MULTILINE)
+
+
+assert insert_lines("// minify insert int x;") == "int x;"
+assert insert_lines("x;\n    // minify insert int y;\n") == "x;\n    int y;\n"
+assert insert_lines("x; // minify insert int y;") == "x; // minify insert int y;"
 
 
 def get_tokens(src: str) -> list:
@@ -394,7 +404,12 @@ def dissect(src: str, settings: Settings = Settings()) -> str:
         found_enum = found_enum or prev == "enum"
         found_template = found_template or prev == "template"
         name_next = name_next or (
-            (prev in types or prev in our_types or (found_define and prev == "define"))
+            (
+                prev in types
+                or prev in our_types
+                or settings.replacements.get(prev) in types
+                or (found_define and prev == "define")
+            )
             and not found_enum
             and not found_include
         )
@@ -0,0 +1,70 @@
+// Searches for the magic numbers that index the slider attack tables, and prints them as main.cpp's bishop_magics and
+// rook_magics. The candidates are sparse draws from a default seeded mt19937_64, bishop then rook for each square in
+// turn, so the output is the same every run. A candidate is kept once no two blocker subsets with different attacks
+// share an index.
+//
+// 4ku is a single file, so it's included whole with its main() moved out of the way. Renamed, it loses the implicit
+// return 0 that only main gets, but it's never called.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wreturn-type"
+#define main engine_main
+#include "main.cpp"
+#undef main
+#pragma GCC diagnostic pop
+
+[[nodiscard]] u64 find_magic(mt19937_64 &r, const int sq, u64 (*func)(int, u64), const u64 mask) {
+    const auto blockers = subsets(mask);
+    vector<u64> attacks;
+    for (const auto b : blockers) {
+        attacks.push_back(func(sq, b));
+    }
+    const int shift = 64 - count(mask);
+
+    // Stamping each slot with the try that filled it saves clearing the table between tries
+    vector<u64> table(blockers.size());
+    vector<size_t> epoch(blockers.size());
+    for (size_t tries = 1;; ++tries) {
+        const u64 magic = r() & r() & r();
+        if (count((mask * magic) >> 56) < 6) {
+            continue;
+        }
+        size_t i = 0;
+        for (; i < blockers.size(); ++i) {
+            const auto idx = (blockers[i] * magic) >> shift;
+            if (epoch[idx] < tries) {
+                epoch[idx] = tries;
+                table[idx] = attacks[i];
+            } else if (table[idx] != attacks[i]) {
+                break;
+            }
+        }
+        if (i == blockers.size()) {
+            return magic;
+        }
+    }
+}
+
+void print(const char *const name, const array<u64, 64> &magics) {
+    printf("const u64 %s[64] = {\n", name);
+    for (int sq = 0; sq < 64; sq += 4) {
+        printf("    0x%016llXULL, 0x%016llXULL, 0x%016llXULL, 0x%016llXULL,\n",
+               static_cast<unsigned long long>(magics[sq]),
+               static_cast<unsigned long long>(magics[sq + 1]),
+               static_cast<unsigned long long>(magics[sq + 2]),
+               static_cast<unsigned long long>(magics[sq + 3]));
+    }
+    printf("};\n");
+}
+
+int main() {
+    mt19937_64 r;
+    array<u64, 64> bishops;
+    array<u64, 64> rooks;
+    for (int sq = 0; sq < 64; ++sq) {
+        bishops[sq] = find_magic(r, sq, bishop_rays, bishop_mask(sq));
+        rooks[sq] = find_magic(r, sq, rook_rays, rook_mask(sq));
+    }
+    print("bishop_magics", bishops);
+    printf("\n");
+    print("rook_magics", rooks);
+}
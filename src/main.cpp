@@ -14,6 +14,7 @@
 // minify replace true 1
 // minify replace false 0
 // minify replace NULL 0
+// minify replace StopFlag int
 
 #include <array>
 #include <cstdint>
@@ -26,7 +27,24 @@
 #include <thread>
 #include <vector>
 // minify enable filter delete
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef SLIDERS_PEXT
+#include <immintrin.h>
+#endif
 // minify disable filter delete
 
 #define MATE_SCORE (1 << 15)
@@ -64,12 +82,38 @@ struct [[nodiscard]] Position {
                             0x1000000000000010ULL};
     u64 ep = 0x0ULL;
     int flipped = false;
+    // minify enable filter delete
+    // Zobrist keys of this position and of its flipped twin, kept up to date by makemove()
+    array<u64, 2> hash = {};
+    // The same for pawns and kings only, to index the pawn hash table
+    array<u64, 2> pawn_hash = {};
+    // Packed material and piece-square terms for our pieces and theirs, and the game phase
+    array<int, 2> psqt = {};
+    int phase = 0;
+    // Piece type on each square, from white's point of view regardless of flipped
+    array<uint8_t, 64> board = {Rook, Knight, Bishop, Queen, King, Bishop, Knight, Rook,
+                                Pawn, Pawn, Pawn, Pawn, Pawn, Pawn, Pawn, Pawn,
+                                None, None, None, None, None, None, None, None,
+                                None, None, None, None, None, None, None, None,
+                                None, None, None, None, None, None, None, None,
+                                None, None, None, None, None, None, None, None,
+                                Pawn, Pawn, Pawn, Pawn, Pawn, Pawn, Pawn, Pawn,
+                                Rook, Knight, Bishop, Queen, King, Bishop, Knight, Rook};
+    // minify disable filter delete
 };
 
 struct Move {
-    int from = 0;
-    int to = 0;
-    int promo = 0;
+    // minify enable filter delete
+    // Packed into 16 bits to keep the move lists in Stack, the killers and the TT small
+    Move(const int f = 0, const int t = 0, const int p = 0) : from(f & 63), to(t & 63), promo(p & 15) {
+    }
+    uint16_t from : 6;
+    uint16_t to : 6;
+    uint16_t promo : 4;
+    // minify disable filter delete
+    // minify insert int from = 0;
+    // minify insert int to = 0;
+    // minify insert int promo = 0;
 };
 
 const Move no_move{};
@@ -77,19 +121,45 @@ const Move no_move{};
 struct [[nodiscard]] Stack {
     Move moves[218];
     Move quiets_evaluated[218];
+    // minify enable filter delete
+    Move captures_evaluated[218];
+    // The move being searched from this ply and the piece making it, None for a null move
+    Move current_move;
+    int moved_piece;
+    // minify disable filter delete
     Move move;
     Move killer;
     int score;
 };
 
 struct [[nodiscard]] TT_Entry {
-    u64 key;
+    // minify enable filter delete
+    // Only the low 16 bits of the hash are kept, the bucket index comes from the high bits
+    uint16_t key;
     Move move;
-    int score;
-    int depth;
-    uint16_t flag;
+    int16_t score;
+    uint8_t depth;
+    uint8_t flag : 2;
+    // Search the entry was written in, 0 marks an empty entry
+    uint8_t generation : 6;
+    // minify disable filter delete
+    // minify insert u64 key;
+    // minify insert Move move;
+    // minify insert int score;
+    // minify insert int depth;
+    // minify insert uint16_t flag;
 };
 
+// minify enable filter delete
+// One cache line worth of entries, so a probe costs at most one miss
+struct alignas(64) TT_Bucket {
+    // Each TT_Entry is kept as a single 64-bit word that's only ever loaded and stored whole with atomic builtins.
+    // Threads racing on an entry then see one complete write or the other, never a key paired with foreign data.
+    array<u64, 8> entries;
+};
+static_assert(sizeof(TT_Entry) == 8 && sizeof(TT_Bucket) == 64);
+// minify disable filter delete
+
 const auto keys = []() {
     mt19937_64 r;
 
@@ -104,10 +174,266 @@ const auto keys = []() {
 }();
 
 // Engine options
-auto num_tt_entries = 64ULL << 15;  // The first value is the size in megabytes
+// minify insert auto num_tt_entries = 64ULL << 15;  // The first value is the size in megabytes
+// minify enable filter delete
+auto num_tt_buckets = 64ULL << 14;  // The first value is the size in megabytes
+// minify disable filter delete
 auto thread_count = 1;
+// minify enable filter delete
+auto num_pawn_entries = 4ULL << 15;  // The first value is the size in megabytes, per thread
+string tt_file = "4ku.tt";
+// minify disable filter delete
+
+// minify enable filter delete
+TT_Bucket *transposition_table = nullptr;
+// Bytes reserved for the table, and whether they came from mmap() rather than operator new
+size_t tt_bytes = 0;
+bool tt_mapped = false;
+// Bumped every search to age out entries, wrapping around within 1-63
+uint8_t tt_generation = 1;
+
+// The table a search probes and stores to, passed down from iteratively_deepen(). UCI searches, bench and the helpers
+// share transposition_table, analyse gives each of its workers one of their own.
+struct [[nodiscard]] TT_Table {
+    TT_Bucket *buckets;
+    u64 num_buckets;
+    uint8_t generation;
+};
+
+[[nodiscard]] TT_Table shared_tt() {
+    return {transposition_table, num_tt_buckets, tt_generation};
+}
+
+[[nodiscard]] TT_Bucket &tt_bucket(const TT_Table &tt, const u64 key) {
+    // Multiply-shift maps the key onto [0, num_buckets) without a division
+    return tt.buckets[static_cast<size_t>(static_cast<unsigned __int128>(key) * tt.num_buckets >> 64)];
+}
+
+[[nodiscard]] TT_Entry tt_load(const u64 &word) {
+    const u64 bits = __atomic_load_n(&word, __ATOMIC_RELAXED);
+    TT_Entry entry;
+    memcpy(static_cast<void *>(&entry), &bits, sizeof(entry));
+    return entry;
+}
+
+void tt_save(u64 &word, const TT_Entry &entry) {
+    u64 bits;
+    memcpy(&bits, &entry, sizeof(bits));
+    __atomic_store_n(&word, bits, __ATOMIC_RELAXED);
+}
+
+[[nodiscard]] bool tt_probe(const TT_Table &tt, const u64 key, TT_Entry &result) {
+    for (const auto &word : tt_bucket(tt, key).entries) {
+        const TT_Entry entry = tt_load(word);
+        if (entry.generation && entry.key == static_cast<uint16_t>(key)) {
+            result = entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Start pulling a child's bucket into cache as soon as its key is known, so the miss overlaps with the work done
+// before the child probes it
+void tt_prefetch([[maybe_unused]] const TT_Table &tt, [[maybe_unused]] const u64 key) {
+#ifndef NO_TT_PREFETCH
+    __builtin_prefetch(&tt_bucket(tt, key));
+#endif
+}
+
+void tt_store(const TT_Table &tt, const u64 key, const Move move, const int score, const int depth, const int flag) {
+    assert(-MATE_SCORE <= score && score < MATE_SCORE && 0 <= depth && depth < 256);
+    // How many searches ago an entry was written, empty entries count as the oldest
+    const auto age = [&](const TT_Entry &entry) {
+        return entry.generation ? (tt.generation - entry.generation + 63) % 63 : 64;
+    };
+    auto &words = tt_bucket(tt, key).entries;
+    // Work on a snapshot of the bucket, another thread overwriting it meanwhile only costs us the replacement choice
+    int replace = 0;
+    TT_Entry entries[8];
+    for (int i = 0; i < 8; ++i) {
+        entries[i] = tt_load(words[i]);
+        if (entries[i].generation && entries[i].key == static_cast<uint16_t>(key)) {
+            // Same position, keep a deeper result from this search unless the new one is exact
+            if (depth < entries[i].depth && flag != 0 && !age(entries[i])) {
+                return;
+            }
+            replace = i;
+            break;
+        }
+        // Otherwise replace the shallowest entry, preferring ones from earlier searches
+        if (entries[i].depth - 4 * age(entries[i]) < entries[replace].depth - 4 * age(entries[replace])) {
+            replace = i;
+        }
+    }
+
+    TT_Entry entry;
+    entry.key = static_cast<uint16_t>(key);
+    entry.move = move;
+    entry.score = static_cast<int16_t>(score);
+    entry.depth = static_cast<uint8_t>(depth);
+    entry.flag = flag & 3;
+    entry.generation = tt.generation & 63;
+    tt_save(words[replace], entry);
+}
+
+void tt_clear() {
+    // Zero the table in parallel, which also faults its pages in on the threads that will use them
+    vector<thread> threads;
+    const size_t chunk = (num_tt_buckets + thread_count - 1) / thread_count;
+    for (int i = 0; i < thread_count; ++i) {
+        threads.emplace_back([=]() {
+            const size_t begin = min<size_t>(i * chunk, num_tt_buckets);
+            const size_t end = min<size_t>(begin + chunk, num_tt_buckets);
+            memset(static_cast<void *>(transposition_table + begin), 0, (end - begin) * sizeof(TT_Bucket));
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    tt_generation = 1;
+}
+
+void tt_free() {
+    if (!transposition_table) {
+        return;
+    }
+#ifdef __linux__
+    if (tt_mapped) {
+        munmap(transposition_table, tt_bytes);
+    } else
+#endif
+    {
+        ::operator delete(transposition_table, align_val_t{2 << 20});
+    }
+    transposition_table = nullptr;
+}
+
+// Probes land all over the table, so back it with huge pages where we can to cut down on TLB misses
+void tt_resize() {
+    tt_free();
+    // Round up to whole 2 MB pages
+    tt_bytes = (num_tt_buckets * sizeof(TT_Bucket) + (2 << 20) - 1) & ~size_t{(2 << 20) - 1};
+    tt_mapped = false;
+#ifdef __linux__
+    // Explicit huge pages only exist if they've been reserved through vm.nr_hugepages, try 1 GB then 2 MB ones
+    for (const int page_bits : {30, 21}) {
+        if (tt_bytes % (size_t{1} << page_bits)) {
+            continue;
+        }
+        void *const table = mmap(nullptr,
+                                 tt_bytes,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_bits << MAP_HUGE_SHIFT),
+                                 -1,
+                                 0);
+        if (table != MAP_FAILED) {
+            transposition_table = static_cast<TT_Bucket *>(table);
+            tt_mapped = true;
+            break;
+        }
+    }
+#endif
+    // Fall back to 2 MB aligned memory that the kernel can back with transparent huge pages
+    if (!transposition_table) {
+        transposition_table = static_cast<TT_Bucket *>(::operator new(tt_bytes, align_val_t{2 << 20}));
+#ifdef MADV_HUGEPAGE
+        madvise(transposition_table, tt_bytes, MADV_HUGEPAGE);
+#endif
+    }
+    tt_clear();
+}
 
-vector<TT_Entry> transposition_table;
+// TT snapshots start with this header, padded out to a page so the table itself can be mapped straight from the file
+struct TT_Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t bucket_size;
+    uint32_t generation;
+    u64 num_buckets;
+};
+
+const char tt_magic[8] = "4ku TT";
+// Bump whenever TT_Entry or TT_Bucket change meaning
+const uint32_t tt_layout_version = 1;
+const size_t tt_header_size = 4096;
+
+// The snapshot is written next to the target and renamed over it, since the live table may be mapped from the target
+// and truncating that would pull the pages out from under it
+[[nodiscard]] bool tt_save_file(const string &path) {
+    const string temp_path = path + ".tmp";
+    FILE *const file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    TT_Header info = {{}, tt_layout_version, sizeof(TT_Entry), sizeof(TT_Bucket), tt_generation, num_tt_buckets};
+    memcpy(info.magic, tt_magic, sizeof(tt_magic));
+    char header[tt_header_size] = {};
+    memcpy(header, &info, sizeof(info));
+    const bool ok = fwrite(header, tt_header_size, 1, file) == 1 &&
+                    fwrite(transposition_table, sizeof(TT_Bucket), num_tt_buckets, file) == num_tt_buckets;
+    if (fclose(file) != 0 || !ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+        remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Replaces the table with a snapshot. On Linux the file is normally mapped copy-on-write, so it's only read in as
+// buckets are touched and loading stays instant however large the snapshot is. Otherwise it's read in whole.
+[[nodiscard]] bool tt_load_file(const string &path) {
+    FILE *const file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    TT_Header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, tt_magic, sizeof(tt_magic)) ||
+        header.version != tt_layout_version || header.entry_size != sizeof(TT_Entry) ||
+        header.bucket_size != sizeof(TT_Bucket) || !header.num_buckets || !header.generation ||
+        header.generation > 63) {
+        fclose(file);
+        return false;
+    }
+    const size_t bytes = header.num_buckets * sizeof(TT_Bucket);
+#ifdef __linux__
+    struct stat st;
+    if (fstat(fileno(file), &st) || static_cast<size_t>(st.st_size) != tt_header_size + bytes) {
+        fclose(file);
+        return false;
+    }
+    // Kernels with pages larger than the header, as on some arm64 and ppc64 systems, can't map the table at its offset
+    // and read it in below instead
+    void *const table = tt_header_size % static_cast<size_t>(sysconf(_SC_PAGESIZE))
+                            ? MAP_FAILED
+                            : mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), tt_header_size);
+    if (table != MAP_FAILED) {
+        fclose(file);
+        tt_free();
+        transposition_table = static_cast<TT_Bucket *>(table);
+        tt_bytes = bytes;
+        tt_mapped = true;
+        num_tt_buckets = header.num_buckets;
+        tt_generation = static_cast<uint8_t>(header.generation);
+        return true;
+    }
+#endif
+    const u64 old_buckets = num_tt_buckets;
+    num_tt_buckets = header.num_buckets;
+    tt_resize();
+    const bool ok = fseek(file, tt_header_size, SEEK_SET) == 0 &&
+                    fread(transposition_table, sizeof(TT_Bucket), num_tt_buckets, file) == num_tt_buckets;
+    fclose(file);
+    if (!ok) {
+        num_tt_buckets = old_buckets;
+        tt_resize();
+        return false;
+    }
+    tt_generation = static_cast<uint8_t>(header.generation);
+    return true;
+}
+// minify disable filter delete
+// minify insert vector<TT_Entry> transposition_table;
 
 [[nodiscard]] u64 flip(const u64 bb) {
     return __builtin_bswap64(bb);
@@ -154,7 +480,16 @@ vector<TT_Entry> transposition_table;
 }
 
 [[nodiscard]] auto operator==(const Move &lhs, const Move &rhs) {
-    return !memcmp(&rhs, &lhs, sizeof(Move));
+    // minify enable filter delete
+    // The bitfields fill all 16 bits, so compare them as one integer
+    static_assert(sizeof(Move) == sizeof(uint16_t));
+    uint16_t a;
+    uint16_t b;
+    memcpy(&a, &lhs, sizeof(a));
+    memcpy(&b, &rhs, sizeof(b));
+    return a == b;
+    // minify disable filter delete
+    // minify insert return !memcmp(&rhs, &lhs, sizeof(Move));
 }
 
 [[nodiscard]] auto move_str(const Move &move, const int flip) {
@@ -169,7 +504,22 @@ vector<TT_Entry> transposition_table;
     return str;
 }
 
-[[nodiscard]] int piece_on(const Position &pos, const int sq) {
+[[nodiscard]] int piece_on(const Position &pos,
+                           const int sq
+                           // minify enable filter delete
+                           ,
+                           const bool mailbox = true
+                           // minify disable filter delete
+) {
+    // minify enable filter delete
+    // The mailbox answers in one load, the bitboard scan below backs it up in debug builds
+    if (mailbox) {
+        const int piece = pos.board[sq ^ 56 * pos.flipped];
+        assert(piece == piece_on(pos, sq, false));
+        return piece;
+    }
+    // minify disable filter delete
+
     const u64 bb = 1ULL << sq;
     for (int i = 0; i < 6; ++i) {
         if (pos.pieces[i] & bb) {
@@ -190,6 +540,11 @@ void flip(Position &pos) {
     swap(pos.castling[0], pos.castling[2]);
     swap(pos.castling[1], pos.castling[3]);
     pos.flipped = !pos.flipped;
+    // minify enable filter delete
+    swap(pos.hash[0], pos.hash[1]);
+    swap(pos.pawn_hash[0], pos.pawn_hash[1]);
+    swap(pos.psqt[0], pos.psqt[1]);
+    // minify disable filter delete
 }
 
 template <typename F>
@@ -210,11 +565,148 @@ template <typename F>
            (((bb << 10) | (bb >> 6)) & 0xFCFCFCFCFCFCFCFCULL) | (((bb << 6) | (bb >> 10)) & 0x3F3F3F3F3F3F3F3FULL);
 }
 
+// minify enable filter delete
+#ifndef SLIDERS_RAY
+// Slider attacks from precomputed tables, indexed either by magic multiplication or by PEXT.
+// Build with -DSLIDERS_RAY to use the ray() fills below instead.
+struct Magic {
+    u64 mask;
+    u64 magic;
+    int shift;
+    int offset;
+};
+
+struct [[nodiscard]] Sliders {
+    array<Magic, 64> bishop;
+    array<Magic, 64> rook;
+    vector<u64> attacks;
+};
+
+// The blockers that change a slider's attacks from sq, a square on the edge of the board never hides another
+[[nodiscard]] u64 bishop_mask(const int sq) {
+    return (ray(sq, 0, nw) | ray(sq, 0, ne) | ray(sq, 0, sw) | ray(sq, 0, se)) & ~0xFF818181818181FFULL;
+}
+
+[[nodiscard]] u64 rook_mask(const int sq) {
+    return (ray(sq, 0, north) & ~0xFF00000000000000ULL) | (ray(sq, 0, east) & ~0x8080808080808080ULL) |
+           (ray(sq, 0, south) & ~0xFFULL) | (ray(sq, 0, west) & ~0x101010101010101ULL);
+}
+
+[[nodiscard]] u64 bishop_rays(const int sq, const u64 blockers) {
+    return ray(sq, blockers, nw) | ray(sq, blockers, ne) | ray(sq, blockers, sw) | ray(sq, blockers, se);
+}
+
+[[nodiscard]] u64 rook_rays(const int sq, const u64 blockers) {
+    return ray(sq, blockers, north) | ray(sq, blockers, east) | ray(sq, blockers, south) | ray(sq, blockers, west);
+}
+
+// Every blocker subset of a mask
+[[nodiscard]] vector<u64> subsets(const u64 mask) {
+    vector<u64> blockers;
+    u64 b = 0;
+    do {
+        blockers.push_back(b);
+        b = (b - mask) & mask;
+    } while (b);
+    return blockers;
+}
+
+// Found by 4ku-magics (src/magics.cpp) rather than searched for on every launch, which took about 0.3 s
+const u64 bishop_magics[64] = {
+    0x0204600410448100ULL, 0x0005014805010000ULL, 0x1410028AB5008000ULL, 0x0902208208100020ULL,
+    0x0804102900009008ULL, 0x0226160220100001ULL, 0x0001010802400400ULL, 0x0820804908200209ULL,
+    0xA00041121404288AULL, 0x0800083288004100ULL, 0x0080104400922440ULL, 0x0040080861000000ULL,
+    0x10800410A8000440ULL, 0x0100012820900000ULL, 0x0341108804422004ULL, 0x8002020600848420ULL,
+    0x0020024083020204ULL, 0x0002303410044109ULL, 0x0041808C08088100ULL, 0x2024000840410810ULL,
+    0x2582000400940000ULL, 0x4042020100820140ULL, 0x1011000098015000ULL, 0x0080944022011000ULL,
+    0x02A0110A04C40800ULL, 0x0001090260022400ULL, 0x0014084004004400ULL, 0x0001004004040002ULL,
+    0x0008840008802000ULL, 0x8030010100804100ULL, 0x2002060880680201ULL, 0x0809004024240400ULL,
+    0x4042101285842000ULL, 0x1044100202080202ULL, 0x0028211001010409ULL, 0x0082840400080120ULL,
+    0x00400080200A0020ULL, 0x23CC080200009040ULL, 0x0004008200008800ULL, 0x0C0890A200810302ULL,
+    0x1004040240008882ULL, 0x0004020202441000ULL, 0x0020208020901000ULL, 0x00C0010401010820ULL,
+    0x2018200940420C00ULL, 0x0841200800400080ULL, 0x0209084104010848ULL, 0x1082040040800210ULL,
+    0x2412988808C01000ULL, 0x0000550490100080ULL, 0x0428002402084000ULL, 0x2840041820880000ULL,
+    0x0204002044340184ULL, 0x6000101290091000ULL, 0x4008109000810042ULL, 0x0020C40090850140ULL,
+    0x0200405210100204ULL, 0x20A40101414C2060ULL, 0x1100849046080410ULL, 0x0800140222050410ULL,
+    0x009100004010CD01ULL, 0xC002002002024200ULL, 0x802020481200E404ULL, 0x8010300088088020ULL,
+};
+
+const u64 rook_magics[64] = {
+    0x2280002080C00112ULL, 0x144002442001D000ULL, 0x0100104020010008ULL, 0x0480080080041000ULL,
+    0x8200100820040200ULL, 0x0500080100020400ULL, 0x0280008001000200ULL, 0x1100006382104100ULL,
+    0x00C1002041008000ULL, 0x0011002100400094ULL, 0x0200801000802000ULL, 0x0000808010000800ULL,
+    0x4200800800800402ULL, 0x0100800200040080ULL, 0x010400082204B001ULL, 0x2402000062008401ULL,
+    0x0201A28002804007ULL, 0x1010004000402010ULL, 0x5880970041002000ULL, 0x0000420008220012ULL,
+    0x6300050011000800ULL, 0x00C1010002080400ULL, 0x0020040001900208ULL, 0x0000020000806114ULL,
+    0x0020800080204000ULL, 0x0000200080804000ULL, 0x0848420200102280ULL, 0x4030100080080084ULL,
+    0x2108004040040200ULL, 0x0001001900040052ULL, 0x0004880400222150ULL, 0x4004086A00009401ULL,
+    0x0C00400022800080ULL, 0x100040A001401000ULL, 0x1000402001001100ULL, 0x90A0801000800800ULL,
+    0x1000800400800800ULL, 0x0104010040400200ULL, 0x0800020804000110ULL, 0x0000A04082000401ULL,
+    0x200A0040810A0020ULL, 0x4010004020004008ULL, 0x0210200010008080ULL, 0x1600090010010020ULL,
+    0x0000040008008080ULL, 0x4881000804010002ULL, 0x0870618802040010ULL, 0x08154080440A0001ULL,
+    0x000080010041A500ULL, 0x0000200185400880ULL, 0x1020021008004240ULL, 0x0048882100100300ULL,
+    0x0144800802040080ULL, 0x0000800400020080ULL, 0x4014020108B00400ULL, 0xC000104081340200ULL,
+    0x0000810440220236ULL, 0x0810120020408102ULL, 0x4100082010804202ULL, 0x0508040821001001ULL,
+    0x0906000820100402ULL, 0x4401000400020801ULL, 0x420400C208100104ULL, 0x8000084104042082ULL,
+};
+
+const auto sliders = []() {
+    Sliders s;
+    s.attacks.reserve(0x1A480);
+
+    const auto init = [&](Magic &m, const int sq, u64 (*func)(int, u64), const u64 mask, const u64 magic) {
+        m.mask = mask;
+        m.magic = magic;
+        m.shift = 64 - count(mask);
+        m.offset = static_cast<int>(s.attacks.size());
+
+        const auto blockers = subsets(mask);
+        s.attacks.resize(s.attacks.size() + blockers.size());
+        for (const auto b : blockers) {
+#ifdef SLIDERS_PEXT
+            const auto idx = _pext_u64(b, mask);
+#else
+            const auto idx = (b * magic) >> m.shift;
+            // Subsets may only share an index if they share their attacks, and no slider attacks nothing
+            assert(!s.attacks[m.offset + idx] || s.attacks[m.offset + idx] == func(sq, b));
+#endif
+            s.attacks[m.offset + idx] = func(sq, b);
+        }
+    };
+
+    for (int sq = 0; sq < 64; ++sq) {
+        init(s.bishop[sq], sq, bishop_rays, bishop_mask(sq), bishop_magics[sq]);
+        init(s.rook[sq], sq, rook_rays, rook_mask(sq), rook_magics[sq]);
+    }
+
+    return s;
+}();
+
+[[nodiscard]] u64 slider(const Magic &m, const u64 blockers) {
+#ifdef SLIDERS_PEXT
+    return sliders.attacks[m.offset + _pext_u64(blockers, m.mask)];
+#else
+    return sliders.attacks[m.offset + (((blockers & m.mask) * m.magic) >> m.shift)];
+#endif
+}
+#endif
+// minify disable filter delete
+
 [[nodiscard]] auto bishop(const int sq, const u64 blockers) {
+    // minify enable filter delete
+#ifndef SLIDERS_RAY
+    return slider(sliders.bishop[sq], blockers);
+#endif
+    // minify disable filter delete
     return ray(sq, blockers, nw) | ray(sq, blockers, ne) | ray(sq, blockers, sw) | ray(sq, blockers, se);
 }
 
 [[nodiscard]] auto rook(const int sq, const u64 blockers) {
+    // minify enable filter delete
+#ifndef SLIDERS_RAY
+    return slider(sliders.rook[sq], blockers);
+#endif
+    // minify disable filter delete
     return ray(sq, blockers, north) | ray(sq, blockers, east) | ray(sq, blockers, south) | ray(sq, blockers, west);
 }
 
@@ -237,12 +729,59 @@ template <typename F>
            (king(sq, 0) & pos.colour[them] & pos.pieces[King]);
 }
 
-auto makemove(Position &pos, const Move &move) {
+// minify enable filter delete
+// Defined alongside the evaluation terms
+[[nodiscard]] int psqt(const int piece, const int sq);
+[[nodiscard]] int piece_phase(const int piece);
+
+// Add or remove a piece in the mailbox, both hashes and the eval accumulators. The flipped twin sees the same piece
+// on the mirrored square, and the owner's piece-square terms are from their own point of view.
+// Every update commutes, so a capture can be applied before or after the capturing piece lands.
+void toggle_piece(Position &pos, const int side, const int piece, const int sq, const bool add) {
+    const int offset = (piece + 6 * (side == pos.flipped)) * 64;
+    pos.hash[0] ^= keys[offset + sq];
+    pos.hash[1] ^= keys[offset + (sq ^ 56)];
+    if (piece == Pawn || piece == King) {
+        pos.pawn_hash[0] ^= keys[offset + sq];
+        pos.pawn_hash[1] ^= keys[offset + (sq ^ 56)];
+    }
+    pos.board[sq ^ 56 * pos.flipped] ^= static_cast<uint8_t>(piece ^ None);
+    pos.psqt[side] += add ? psqt(piece, sq ^ 56 * side) : -psqt(piece, sq ^ 56 * side);
+    pos.phase += add ? piece_phase(piece) : -piece_phase(piece);
+}
+
+void hash_ep(Position &pos) {
+    if (pos.ep) {
+        pos.hash[0] ^= keys[768 + lsb(pos.ep)];
+        pos.hash[1] ^= keys[768 + (lsb(pos.ep) ^ 56)];
+    }
+}
+
+void hash_castling(Position &pos) {
+    pos.hash[0] ^= keys[832 + (pos.castling[0] | pos.castling[1] << 1 | pos.castling[2] << 2 | pos.castling[3] << 3)];
+    pos.hash[1] ^= keys[832 + (pos.castling[2] | pos.castling[3] << 1 | pos.castling[0] << 2 | pos.castling[1] << 3)];
+}
+// minify disable filter delete
+
+auto makemove(Position &pos,
+              const Move &move
+              // minify enable filter delete
+              ,
+              const bool legal = true
+              // minify disable filter delete
+) {
     const int piece = piece_on(pos, move.from);
     const int captured = piece_on(pos, move.to);
     const u64 to = 1ULL << move.to;
     const u64 from = 1ULL << move.from;
 
+    // minify enable filter delete
+    hash_ep(pos);
+    hash_castling(pos);
+    toggle_piece(pos, 0, piece, move.from, false);
+    toggle_piece(pos, 0, piece, move.to, true);
+    // minify disable filter delete
+
     // Move the piece
     pos.colour[0] ^= from | to;
     pos.pieces[piece] ^= from | to;
@@ -251,6 +790,9 @@ auto makemove(Position &pos, const Move &move) {
     if (piece == Pawn && to == pos.ep) {
         pos.colour[1] ^= to >> 8;
         pos.pieces[Pawn] ^= to >> 8;
+        // minify enable filter delete
+        toggle_piece(pos, 1, Pawn, move.to - 8, false);
+        // minify disable filter delete
     }
 
     pos.ep = 0x0ULL;
@@ -264,6 +806,9 @@ auto makemove(Position &pos, const Move &move) {
     if (captured != None) {
         pos.colour[1] ^= to;
         pos.pieces[captured] ^= to;
+        // minify enable filter delete
+        toggle_piece(pos, 1, captured, move.to, false);
+        // minify disable filter delete
     }
 
     // Castling
@@ -271,12 +816,22 @@ auto makemove(Position &pos, const Move &move) {
         const u64 bb = move.to - move.from == 2 ? 0xa0ULL : move.to - move.from == -2 ? 0x9ULL : 0x0ULL;
         pos.colour[0] ^= bb;
         pos.pieces[Rook] ^= bb;
+        // minify enable filter delete
+        if (bb) {
+            toggle_piece(pos, 0, Rook, lsb(bb & 0x81ULL), false);
+            toggle_piece(pos, 0, Rook, lsb(bb & 0x28ULL), true);
+        }
+        // minify disable filter delete
     }
 
     // Promotions
     if (piece == Pawn && move.to >= 56) {
         pos.pieces[Pawn] ^= to;
         pos.pieces[move.promo] ^= to;
+        // minify enable filter delete
+        toggle_piece(pos, 0, Pawn, move.to, false);
+        toggle_piece(pos, 0, move.promo, move.to, true);
+        // minify disable filter delete
     }
 
     // Update castling permissions
@@ -285,8 +840,21 @@ auto makemove(Position &pos, const Move &move) {
     pos.castling[2] &= !((from | to) & 0x9000000000000000ULL);
     pos.castling[3] &= !((from | to) & 0x1100000000000000ULL);
 
+    // minify enable filter delete
+    hash_ep(pos);
+    hash_castling(pos);
+    // minify disable filter delete
+
     flip(pos);
 
+    // minify enable filter delete
+    // The full build only generates legal moves, see filter_legal(), so there's nothing to check
+    if (legal) {
+        assert(!attacked(pos, lsb(pos.colour[1] & pos.pieces[King]), false));
+        return true;
+    }
+    // minify disable filter delete
+
     // Return move legality
     return !attacked(pos, lsb(pos.colour[1] & pos.pieces[King]), false);
 }
@@ -295,6 +863,138 @@ void add_move(Move *const movelist, int &num_moves, const int from, const int to
     movelist[num_moves++] = Move{from, to, promo};
 }
 
+// minify enable filter delete
+// Pieces of either colour attacking a square, with sliders seeing through anything missing from occupied
+[[nodiscard]] u64 attackers(const Position &pos, const int sq, const u64 occupied) {
+    const u64 bb = 1ULL << sq;
+    return (pos.colour[1] & pos.pieces[Pawn] & (nw(bb) | ne(bb))) |
+           (pos.colour[0] & pos.pieces[Pawn] & (sw(bb) | se(bb))) | (knight(sq, 0) & pos.pieces[Knight]) |
+           (bishop(sq, occupied) & (pos.pieces[Bishop] | pos.pieces[Queen])) |
+           (rook(sq, occupied) & (pos.pieces[Rook] | pos.pieces[Queen])) | (king(sq, 0) & pos.pieces[King]);
+}
+
+// Squares strictly between two squares on a shared rank, file or diagonal
+[[nodiscard]] u64 between(const int a, const int b) {
+    if (bishop(a, 0) & (1ULL << b)) {
+        return bishop(a, 1ULL << b) & bishop(b, 1ULL << a);
+    }
+    if (rook(a, 0) & (1ULL << b)) {
+        return rook(a, 1ULL << b) & rook(b, 1ULL << a);
+    }
+    return 0;
+}
+
+// Every square on the line through two aligned squares
+[[nodiscard]] u64 line(const int a, const int b) {
+    const u64 ends = (1ULL << a) | (1ULL << b);
+    if (bishop(a, 0) & (1ULL << b)) {
+        return (bishop(a, 0) & bishop(b, 0)) | ends;
+    }
+    return (rook(a, 0) & rook(b, 0)) | ends;
+}
+
+const int see_values[] = {100, 300, 300, 500, 900, 0, 0};
+
+// Static exchange evaluation, whether the captures on the target square win at least threshold. Each side recaptures
+// with its least valuable attacker, and sliders behind the pieces that have already captured join in as x-rays.
+[[nodiscard]] bool see(const Position &pos, const Move &move, const int threshold) {
+    int swap = see_values[piece_on(pos, move.to)] - threshold;
+    if (swap < 0) {
+        return false;
+    }
+    swap = see_values[piece_on(pos, move.from)] - swap;
+    if (swap <= 0) {
+        return true;
+    }
+
+    const u64 bishops = pos.pieces[Bishop] | pos.pieces[Queen];
+    const u64 rooks = pos.pieces[Rook] | pos.pieces[Queen];
+    u64 occupied = (pos.colour[0] | pos.colour[1]) ^ (1ULL << move.from) ^ (1ULL << move.to);
+    u64 attacking = attackers(pos, move.to, occupied);
+    int side = 0;
+    int result = 1;
+    while (true) {
+        side ^= 1;
+        attacking &= occupied;
+        const u64 ours = attacking & pos.colour[side];
+        if (!ours) {
+            break;
+        }
+        result ^= 1;
+
+        int piece = Pawn;
+        while (!(ours & pos.pieces[piece])) {
+            piece++;
+        }
+        // The king can only recapture once the square isn't defended any more
+        if (piece == King) {
+            return attacking & pos.colour[side ^ 1] ? result ^ 1 : result;
+        }
+        swap = see_values[piece] - swap;
+        if (swap < result) {
+            break;
+        }
+        occupied ^= 1ULL << lsb(ours & pos.pieces[piece]);
+        if (piece == Pawn || piece == Bishop || piece == Queen) {
+            attacking |= bishop(move.to, occupied) & bishops;
+        }
+        if (piece == Rook || piece == Queen) {
+            attacking |= rook(move.to, occupied) & rooks;
+        }
+    }
+    return result;
+}
+
+// Whether a pseudo-legal move keeps our king out of check, found the way 4ku-mini does by making it
+[[nodiscard]] bool leaves_king_safe(const Position &pos, const Move &move) {
+    auto npos = pos;
+    return makemove(npos, move, false);
+}
+
+// Remove the moves that would leave our king in check. Other pieces must block or capture a single checker and stay
+// on their pin ray, while the king mustn't step onto an attacked square.
+[[nodiscard]] int filter_legal(const Position &pos, Move *const movelist, const int num_moves) {
+    const u64 all = pos.colour[0] | pos.colour[1];
+    const int ksq = lsb(pos.colour[0] & pos.pieces[King]);
+    const u64 checkers = attackers(pos, ksq, all) & pos.colour[1];
+    const u64 check_mask = !checkers           ? ~0ULL
+                           : count(checkers) > 1 ? 0ULL
+                                                 : checkers | between(ksq, lsb(checkers));
+
+    u64 pinned = 0;
+    u64 snipers = pos.colour[1] & ((bishop(ksq, pos.colour[1]) & (pos.pieces[Bishop] | pos.pieces[Queen])) |
+                                   (rook(ksq, pos.colour[1]) & (pos.pieces[Rook] | pos.pieces[Queen])));
+    while (snipers) {
+        const u64 blockers = between(ksq, lsb(snipers)) & all;
+        snipers &= snipers - 1;
+        if (count(blockers) == 1) {
+            pinned |= blockers & pos.colour[0];
+        }
+    }
+
+    int num_legal = 0;
+    for (int i = 0; i < num_moves; ++i) {
+        const Move &move = movelist[i];
+        const u64 to = 1ULL << move.to;
+        bool legal;
+        if (move.from == ksq) {
+            legal = !(attackers(pos, move.to, all ^ (1ULL << ksq)) & pos.colour[1]);
+        } else if (to == pos.ep && piece_on(pos, move.from) == Pawn) {
+            // Two pawns leave the board at once, which can uncover an attack on the king
+            const u64 occupied = all ^ (1ULL << move.from) ^ to ^ (to >> 8);
+            legal = !(attackers(pos, ksq, occupied) & pos.colour[1] & ~(to >> 8));
+        } else {
+            legal = (to & check_mask) && (!((1ULL << move.from) & pinned) || (to & line(ksq, move.from)));
+        }
+        assert(legal == leaves_king_safe(pos, move));
+        if (legal) {
+            movelist[num_legal++] = move;
+        }
+    }
+    return num_legal;
+}
+// minify disable filter delete
+
 void generate_pawn_moves(Move *const movelist, int &num_moves, u64 to_mask, const int offset) {
     while (to_mask) {
         const int to = lsb(to_mask);
@@ -352,9 +1052,88 @@ void generate_piece_moves(Move *const movelist,
     if (!only_captures && pos.castling[1] && !(all & 0xEULL) && !attacked(pos, 4) && !attacked(pos, 3)) {
         add_move(movelist, num_moves, 4, 2);
     }
+    // minify enable filter delete
+    num_moves = filter_legal(pos, movelist, num_moves);
+    // minify disable filter delete
     return num_moves;
 }
 
+// minify enable filter delete
+// The non-captures that movegen(pos, movelist, true) leaves out, in the same order movegen() would produce them
+[[nodiscard]] auto movegen_quiets(const Position &pos, Move *const movelist) {
+    int num_moves = 0;
+    const u64 all = pos.colour[0] | pos.colour[1];
+    const u64 pawns = pos.colour[0] & pos.pieces[Pawn];
+    generate_pawn_moves(movelist, num_moves, north(pawns) & ~all & ~0xFF00000000000000ULL, -8);
+    generate_pawn_moves(movelist, num_moves, north(north(pawns & 0xFF00ULL) & ~all) & ~all, -16);
+    generate_piece_moves(movelist, num_moves, pos, Knight, ~all, knight);
+    generate_piece_moves(movelist, num_moves, pos, Bishop, ~all, bishop);
+    generate_piece_moves(movelist, num_moves, pos, Queen, ~all, bishop);
+    generate_piece_moves(movelist, num_moves, pos, Rook, ~all, rook);
+    generate_piece_moves(movelist, num_moves, pos, Queen, ~all, rook);
+    generate_piece_moves(movelist, num_moves, pos, King, ~all, king);
+    if (pos.castling[0] && !(all & 0x60ULL) && !attacked(pos, 4) && !attacked(pos, 5)) {
+        add_move(movelist, num_moves, 4, 6);
+    }
+    if (pos.castling[1] && !(all & 0xEULL) && !attacked(pos, 4) && !attacked(pos, 3)) {
+        add_move(movelist, num_moves, 4, 2);
+    }
+    return filter_legal(pos, movelist, num_moves);
+}
+
+// Whether a move would be generated by movegen(pos, movelist, true)
+[[nodiscard]] bool is_noisy(const Position &pos, const Move &move) {
+    return piece_on(pos, move.to) != None ||
+           (piece_on(pos, move.from) == Pawn && (move.to >= 56 || (1ULL << move.to) == pos.ep));
+}
+
+[[nodiscard]] bool is_generated(const Position &pos, const Move &move) {
+    Move moves[256];
+    const int num_moves = movegen(pos, moves, false);
+    for (int i = 0; i < num_moves; ++i) {
+        if (moves[i] == move) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Check a move that didn't come from movegen(), such as a TT move or a killer, without generating any moves
+[[nodiscard]] bool is_pseudolegal_move(const Position &pos, const Move &move) {
+    const u64 all = pos.colour[0] | pos.colour[1];
+    const u64 from = 1ULL << move.from;
+    const u64 to = 1ULL << move.to;
+    const int piece = piece_on(pos, move.from);
+    bool valid = false;
+
+    if (!(pos.colour[0] & from) || pos.colour[0] & to || (piece == Pawn && move.to >= 56) != (move.promo != None)) {
+        valid = false;
+    } else if (piece == Pawn) {
+        valid = (north(from) & ~all & to) || (north(north(from & 0xFF00ULL) & ~all) & ~all & to) ||
+                ((nw(from) | ne(from)) & (pos.colour[1] | pos.ep) & to);
+    } else if (piece == King && move.from == 4 && move.to == 6) {
+        valid = pos.castling[0] && !(all & 0x60ULL) && !attacked(pos, 4) && !attacked(pos, 5);
+    } else if (piece == King && move.from == 4 && move.to == 2) {
+        valid = pos.castling[1] && !(all & 0xEULL) && !attacked(pos, 4) && !attacked(pos, 3);
+    } else {
+        const u64 moves = piece == Knight   ? knight(move.from, all)
+                          : piece == Bishop ? bishop(move.from, all)
+                          : piece == Rook   ? rook(move.from, all)
+                          : piece == Queen  ? bishop(move.from, all) | rook(move.from, all)
+                                            : king(move.from, all);
+        valid = moves & to;
+    }
+
+    return valid;
+}
+
+[[nodiscard]] bool is_legal_move(const Position &pos, Move move) {
+    const bool legal = is_pseudolegal_move(pos, move) && filter_legal(pos, &move, 1);
+    assert(legal == is_generated(pos, move));
+    return legal;
+}
+// minify disable filter delete
+
 [[nodiscard]] int S(const int mg, const int eg) {
     return (eg << 16) + mg;
 }
@@ -384,30 +1163,246 @@ const int rook_rank78 = S(34, 1);
 const int king_shield[] = {S(36, -13), S(16, -15), S(-89, 30)};
 const int pawn_attacked[] = {S(-64, -14), S(-55, -42)};
 
-[[nodiscard]] int eval(Position &pos) {
-    // Include side to move bonus
-    int score = S(16, 8);
-    int phase = 0;
-
-    for (int c = 0; c < 2; ++c) {
-        // our pawns, their pawns
-        const u64 pawns[] = {pos.colour[0] & pos.pieces[Pawn], pos.colour[1] & pos.pieces[Pawn]};
-        const u64 protected_by_pawns = nw(pawns[0]) | ne(pawns[0]);
-        const u64 attacked_by_pawns = se(pawns[1]) | sw(pawns[1]);
-        const int kings[] = {lsb(pos.colour[0] & pos.pieces[King]), lsb(pos.colour[1] & pos.pieces[King])};
-
-        // Bishop pair
-        if (count(pos.colour[0] & pos.pieces[Bishop]) == 2) {
-            score += bishop_pair;
+// minify enable filter delete
+// Material, centrality, outside file and quadrant terms for each piece on each square, from its owner's point of view
+const auto psqt_table = []() {
+    array<array<int, 64>, 6> table;
+    for (int p = 0; p < 6; ++p) {
+        for (int sq = 0; sq < 64; ++sq) {
+            const int rank = sq / 8;
+            const int file = sq % 8;
+            const int centrality = (7 - abs(7 - rank - file) - abs(rank - file)) / 2;
+            table[p][sq] = material[p] + centrality * centralities[p] + abs(file - 3) * outside_files[p] +
+                           psts[p][(rank / 4) * 2 + file / 4];
         }
+    }
+    return table;
+}();
 
-        // For each piece type
-        for (int p = 0; p < 6; ++p) {
-            auto copy = pos.colour[0] & pos.pieces[p];
-            while (copy) {
-                phase += phases[p];
+[[nodiscard]] int psqt(const int piece, const int sq) {
+    return psqt_table[piece][sq];
+}
 
-                const int sq = lsb(copy);
+[[nodiscard]] int piece_phase(const int piece) {
+    return phases[piece];
+}
+// minify disable filter delete
+
+// minify enable filter delete
+// Search statistics for comparing versions, only collected in builds with SEARCH_STATS so they cost nothing otherwise.
+// Each thread counts into its own copy and hands it to ThreadData when its search ends.
+#ifdef SEARCH_STATS
+#define STAT(...) (__VA_ARGS__)
+#else
+#define STAT(...)
+#endif
+
+struct [[nodiscard]] SearchStats {
+    // Every alphabeta call, so unlike the reported nodes these include the roots and null move searches
+    int64_t main_nodes = 0;
+    int64_t qsearch_nodes = 0;
+    int64_t tt_probes = 0;
+    int64_t tt_hits = 0;
+    int64_t tt_cutoffs = 0;
+    int64_t beta_cutoffs = 0;
+    int64_t first_move_cutoffs = 0;
+    int64_t null_tries = 0;
+    int64_t null_cutoffs = 0;
+    int64_t lmr_searches = 0;
+    int64_t lmr_researches = 0;
+    int64_t reverse_futility_prunes = 0;
+    int64_t futility_prunes = 0;
+    int64_t see_prunes = 0;
+    int64_t lmp_prunes = 0;
+    int64_t delta_prunes = 0;
+    int64_t pawn_probes = 0;
+    int64_t pawn_hits = 0;
+    // Main search moves searched and the nodes that searched any, for the average branching factor
+    int64_t moves_searched = 0;
+    int64_t expanded_nodes = 0;
+    int seldepth = 0;
+};
+
+thread_local SearchStats search_stats;
+
+// Pawn structure and king shelter terms only depend on where the pawns and kings are, so they're cached per thread
+struct [[nodiscard]] PawnEntry {
+    u64 key;
+    int score;
+    // Passed pawns for both sides, with the blocked passer term left to eval() as it depends on other pieces
+    array<u64, 2> passed;
+};
+
+thread_local vector<PawnEntry> pawn_table;
+
+[[nodiscard]] PawnEntry eval_pawns(const Position &pos) {
+    PawnEntry entry{pos.pawn_hash[0], 0, {}};
+    const auto side = [](const u64 own, const u64 other, const array<int, 2> kings, u64 &passed) {
+        int score = 0;
+        u64 copy = own;
+        while (copy) {
+            const int sq = lsb(copy);
+            copy &= copy - 1;
+            const int rank = sq / 8;
+            const int file = sq % 8;
+            const u64 piece_bb = 1ULL << sq;
+
+            // Passed pawns
+            u64 blockers = 0x101010101010101ULL << sq;
+            blockers = nw(blockers) | ne(blockers);
+            if (!(blockers & other)) {
+                passed |= piece_bb;
+                score += passers[rank - 1];
+
+                // King defense/attack
+                // king distance to square in front of passer
+                for (int i = 0; i < 2; ++i) {
+                    score += pawn_passed_king_distance[i] * (rank - 1) *
+                             max(abs((kings[i] / 8) - (rank + 1)), abs((kings[i] % 8) - file));
+                }
+            }
+
+            // Doubled pawns
+            if ((north(piece_bb) | north(north(piece_bb))) & own) {
+                score += pawn_doubled;
+            }
+        }
+
+        // King shield
+        const u64 king_bb = 1ULL << kings[0];
+        if (king_bb & 0xE7) {
+            const u64 shield = kings[0] % 8 < 3 ? 0x700 : 0xE000;
+            score += count(shield & own) * king_shield[0];
+            score += count(north(shield) & own) * king_shield[1];
+
+            // C3D7 = Reasonable king squares
+            score += !(king_bb & 0xC3D7) * king_shield[2];
+        }
+        return score;
+    };
+
+    const u64 pawns[] = {pos.colour[0] & pos.pieces[Pawn], pos.colour[1] & pos.pieces[Pawn]};
+    const int kings[] = {lsb(pos.colour[0] & pos.pieces[King]), lsb(pos.colour[1] & pos.pieces[King])};
+    entry.score = side(pawns[0], pawns[1], {kings[0], kings[1]}, entry.passed[0]) -
+                  side(flip(pawns[1]), flip(pawns[0]), {kings[1] ^ 56, kings[0] ^ 56}, entry.passed[1]);
+    entry.passed[1] = flip(entry.passed[1]);
+    return entry;
+}
+
+// The same evaluation as eval(), built on the incrementally updated terms in Position and the pawn hash table
+[[nodiscard]] int eval_incremental(const Position &pos) {
+    // Include side to move bonus
+    int score = S(16, 8) + pos.psqt[0] - pos.psqt[1];
+
+    // Pawn structure
+    if (pawn_table.size() != num_pawn_entries) {
+        pawn_table.assign(num_pawn_entries, {});
+    }
+    PawnEntry &entry = pawn_table[pos.pawn_hash[0] % num_pawn_entries];
+    STAT(search_stats.pawn_probes++);
+    if (entry.key == pos.pawn_hash[0]) {
+        STAT(search_stats.pawn_hits++);
+    } else {
+        entry = eval_pawns(pos);
+    }
+    assert(entry.score == eval_pawns(pos).score && entry.passed == eval_pawns(pos).passed);
+    score += entry.score;
+
+    // Blocked passed pawns
+    score += (count(north(entry.passed[0]) & pos.colour[1]) - count(south(entry.passed[1]) & pos.colour[0])) *
+             pawn_passed_blocked;
+
+    for (int c = 0; c < 2; ++c) {
+        // Bitboards from this side's point of view
+        const auto view = [c](const u64 bb) {
+            return c ? flip(bb) : bb;
+        };
+        const u64 own = view(pos.colour[c]);
+        // our pawns, their pawns
+        const u64 pawns[] = {own & view(pos.pieces[Pawn]), view(pos.colour[!c] & pos.pieces[Pawn])};
+        const u64 protected_by_pawns = nw(pawns[0]) | ne(pawns[0]);
+        const u64 attacked_by_pawns = se(pawns[1]) | sw(pawns[1]);
+        int side_score = 0;
+
+        // Bishop pair
+        if (count(pos.colour[c] & pos.pieces[Bishop]) == 2) {
+            side_score += bishop_pair;
+        }
+
+        // Pawn protection
+        for (int p = 0; p < 6; ++p) {
+            side_score += count(own & view(pos.pieces[p]) & protected_by_pawns) * pawn_protection[p];
+        }
+
+        // Pieces attacked by pawns
+        side_score += count(own & ~pawns[0] & attacked_by_pawns) * pawn_attacked[c];
+
+        // Rook on open or semi-open files
+        u64 rooks = own & view(pos.pieces[Rook]);
+        while (rooks) {
+            const int sq = lsb(rooks);
+            rooks &= rooks - 1;
+            const u64 file_bb = 0x101010101010101ULL << (sq % 8);
+            if (!(file_bb & pawns[0])) {
+                if (!(file_bb & pawns[1])) {
+                    side_score += rook_open;
+                } else {
+                    side_score += rook_semi_open;
+                }
+            }
+
+            // Rook on 7th or 8th rank
+            if (sq >= 48) {
+                side_score += rook_rank78;
+            }
+        }
+
+        score += c ? -side_score : side_score;
+    }
+
+    // Tapered eval
+    return ((short)score * pos.phase + ((score + 0x8000) >> 16) * (24 - pos.phase)) / 24;
+}
+// minify disable filter delete
+
+[[nodiscard]] int eval(Position &pos
+                       // minify enable filter delete
+                       ,
+                       const bool incremental = true
+                       // minify disable filter delete
+) {
+    // minify enable filter delete
+    // The full evaluation below backs up the incremental terms in debug builds
+    if (incremental) {
+        const int score = eval_incremental(pos);
+        assert(score == eval(pos, false));
+        return score;
+    }
+    // minify disable filter delete
+
+    // Include side to move bonus
+    int score = S(16, 8);
+    int phase = 0;
+
+    for (int c = 0; c < 2; ++c) {
+        // our pawns, their pawns
+        const u64 pawns[] = {pos.colour[0] & pos.pieces[Pawn], pos.colour[1] & pos.pieces[Pawn]};
+        const u64 protected_by_pawns = nw(pawns[0]) | ne(pawns[0]);
+        const u64 attacked_by_pawns = se(pawns[1]) | sw(pawns[1]);
+        const int kings[] = {lsb(pos.colour[0] & pos.pieces[King]), lsb(pos.colour[1] & pos.pieces[King])};
+
+        // Bishop pair
+        if (count(pos.colour[0] & pos.pieces[Bishop]) == 2) {
+            score += bishop_pair;
+        }
+
+        // For each piece type
+        for (int p = 0; p < 6; ++p) {
+            auto copy = pos.colour[0] & pos.pieces[p];
+            while (copy) {
+                phase += phases[p];
+
+                const int sq = lsb(copy);
                 copy &= copy - 1;
                 const int rank = sq / 8;
                 const int file = sq % 8;
@@ -495,7 +1490,18 @@ const int pawn_attacked[] = {S(-64, -14), S(-55, -42)};
     return ((short)score * phase + ((score + 0x8000) >> 16) * (24 - phase)) / 24;
 }
 
-[[nodiscard]] auto get_hash(const Position &pos) {
+[[nodiscard]] auto get_hash(const Position &pos
+                           // minify enable filter delete
+                           ,
+                           const bool incremental = true
+                           // minify disable filter delete
+) {
+    // minify enable filter delete
+    if (incremental) {
+        return pos.hash[0];
+    }
+    // minify disable filter delete
+
     u64 hash = pos.flipped;
 
     // Pieces
@@ -517,6 +1523,147 @@ const int pawn_attacked[] = {S(-64, -14), S(-55, -42)};
     return hash;
 }
 
+// minify enable filter delete
+// A copy of a position with its incrementally updated state recomputed from scratch
+[[nodiscard]] Position refreshed(Position pos) {
+    pos.psqt = {};
+    pos.phase = 0;
+    pos.pawn_hash = {static_cast<u64>(pos.flipped), static_cast<u64>(!pos.flipped)};
+    for (int side = 0; side < 2; ++side) {
+        for (int p = 0; p < 6; ++p) {
+            u64 copy = pos.colour[side] & pos.pieces[p];
+            while (copy) {
+                const int sq = lsb(copy);
+                copy &= copy - 1;
+                pos.psqt[side] += psqt(p, sq ^ 56 * side);
+                pos.phase += phases[p];
+                if (p == Pawn || p == King) {
+                    const int offset = (p + 6 * (side == pos.flipped)) * 64;
+                    pos.pawn_hash[0] ^= keys[offset + sq];
+                    pos.pawn_hash[1] ^= keys[offset + (sq ^ 56)];
+                }
+            }
+        }
+    }
+
+    auto npos = pos;
+    flip(npos);
+    pos.hash = {get_hash(pos, false), get_hash(npos, false)};
+    return pos;
+}
+
+// Every position a search, perft or analyse starts from needs its incremental state, which a default constructed one
+// only has once it's been through refreshed() or set_fen()
+[[nodiscard]] bool is_refreshed(const Position &pos) {
+    const auto fresh = refreshed(pos);
+    return pos.hash == fresh.hash && pos.pawn_hash == fresh.pawn_hash && pos.psqt == fresh.psqt &&
+           pos.phase == fresh.phase;
+}
+// minify disable filter delete
+
+// minify enable filter delete
+// Restricted by go searchmoves, every root move is searched when it's empty
+vector<Move> root_moves;
+
+// Thread 0 searches the root once per MultiPV line, skipping the moves already found for the earlier lines
+int multipv = 1;
+thread_local vector<Move> excluded_moves;
+
+// Move ordering statistics besides the butterfly table, one set per search thread
+const int history_max = 16384;
+
+struct [[nodiscard]] Histories {
+    // The quiet reply that last refuted a move, by that move's piece and destination
+    Move counter_moves[7][64];
+    // By the piece and destination of the move one [0] or two [1] plies back, then this move's piece and destination.
+    // The root and null moves have a piece of None, which gets its own row.
+    int continuation[2][7][64][6][64];
+    // By moving piece, destination and captured piece
+    int capture[6][64][6];
+};
+
+// Gravity, a bonus moves an entry less the closer it already is to +-history_max so it never leaves that range
+template <typename T>
+void update_history(T &entry, const int bonus) {
+    entry += bonus - entry * abs(bonus) / history_max;
+}
+
+void add_stats(SearchStats &total, const SearchStats &stats) {
+    total.main_nodes += stats.main_nodes;
+    total.qsearch_nodes += stats.qsearch_nodes;
+    total.tt_probes += stats.tt_probes;
+    total.tt_hits += stats.tt_hits;
+    total.tt_cutoffs += stats.tt_cutoffs;
+    total.beta_cutoffs += stats.beta_cutoffs;
+    total.first_move_cutoffs += stats.first_move_cutoffs;
+    total.null_tries += stats.null_tries;
+    total.null_cutoffs += stats.null_cutoffs;
+    total.lmr_searches += stats.lmr_searches;
+    total.lmr_researches += stats.lmr_researches;
+    total.reverse_futility_prunes += stats.reverse_futility_prunes;
+    total.futility_prunes += stats.futility_prunes;
+    total.see_prunes += stats.see_prunes;
+    total.lmp_prunes += stats.lmp_prunes;
+    total.delta_prunes += stats.delta_prunes;
+    total.pawn_probes += stats.pawn_probes;
+    total.pawn_hits += stats.pawn_hits;
+    total.moves_searched += stats.moves_searched;
+    total.expanded_nodes += stats.expanded_nodes;
+    total.seldepth = max(total.seldepth, stats.seldepth);
+}
+
+[[nodiscard]] string percent(const int64_t part, const int64_t whole) {
+    const int64_t tenths = whole ? part * 1000 / whole : 0;
+    return to_string(tenths / 10) + "." + to_string(tenths % 10) + "%";
+}
+
+void print_stats(const SearchStats &stats) {
+    const int64_t nodes = stats.main_nodes + stats.qsearch_nodes;
+    const int64_t branching = stats.expanded_nodes ? stats.moves_searched * 100 / stats.expanded_nodes : 0;
+    cout << "info string stats nodes " << nodes << " qsearch " << percent(stats.qsearch_nodes, nodes) << "\n";
+    cout << "info string stats tt probes " << stats.tt_probes << " hits " << percent(stats.tt_hits, stats.tt_probes)
+         << " cutoffs " << percent(stats.tt_cutoffs, stats.tt_probes) << "\n";
+    cout << "info string stats beta cutoffs " << stats.beta_cutoffs << " first move "
+         << percent(stats.first_move_cutoffs, stats.beta_cutoffs) << "\n";
+    cout << "info string stats null move tries " << stats.null_tries << " cutoffs "
+         << percent(stats.null_cutoffs, stats.null_tries) << "\n";
+    cout << "info string stats lmr searches " << stats.lmr_searches << " researched "
+         << percent(stats.lmr_researches, stats.lmr_searches) << "\n";
+    cout << "info string stats pruned reverse futility " << stats.reverse_futility_prunes << " futility "
+         << stats.futility_prunes << " see " << stats.see_prunes << " lmp " << stats.lmp_prunes << " delta "
+         << stats.delta_prunes << "\n";
+    cout << "info string stats pawn hash probes " << stats.pawn_probes << " hits "
+         << percent(stats.pawn_hits, stats.pawn_probes) << "\n";
+    cout << "info string stats branching factor " << branching / 100 << "." << branching / 10 % 10 << branching % 10
+         << " seldepth " << stats.seldepth << endl;
+}
+
+// Limits for the current search, set by go. The hard time limit is passed down as allocated_time, thread 0 also
+// stops iterating once it's past the soft limit or at the depth limit. The node limit is on the nodes of all the
+// threads together.
+struct [[nodiscard]] SearchLimits {
+    int hard_time = 1 << 30;
+    int soft_time = 1 << 30;
+    int depth = 127;
+    int64_t nodes = INT64_MAX;
+};
+
+SearchLimits limits;
+
+// Reading the clock is a syscall, so thread 0 only does it every poll_nodes nodes and stops the others through the
+// shared flag. At typical speeds the default keeps the stop latency well under a millisecond.
+int poll_nodes = 1024;
+thread_local bool polls_clock = false;
+thread_local int nodes_until_poll = 0;
+// The UCI search threads add their nodes up here when they poll, so with several threads the node limit can be
+// overshot by about poll_nodes per thread. A single thread also checks its own count every node and stops exactly.
+atomic<int64_t> pool_nodes{0};
+thread_local atomic<int64_t> *node_total = nullptr;
+thread_local int64_t nodes_counted = 0;
+// Several threads watch the same flag, 4ku-mini gives each of its threads an int of its own
+using StopFlag = atomic<int>;
+// minify disable filter delete
+
 int alphabeta(Position &pos,
               int alpha,
               const int beta,
@@ -526,9 +1673,13 @@ int alphabeta(Position &pos,
               int64_t &nodes,
               // minify disable filter delete
               const int64_t stop_time,
-              int &stop,
+              StopFlag &stop,
               Stack *const stack,
               int64_t (&hh_table)[2][64][64],
+              // minify enable filter delete
+              Histories &histories,
+              const TT_Table &tt,
+              // minify disable filter delete
               vector<u64> &hash_history,
               const int do_null = true) {
     const int static_eval = eval(pos);
@@ -546,6 +1697,10 @@ int alphabeta(Position &pos,
     depth = in_check ? max(1, depth + 1) : depth;
 
     const int in_qsearch = depth <= 0;
+    // minify enable filter delete
+    STAT(in_qsearch ? search_stats.qsearch_nodes++ : search_stats.main_nodes++);
+    STAT(search_stats.seldepth = max(search_stats.seldepth, ply));
+    // minify disable filter delete
     if (in_qsearch && static_eval > alpha) {
         if (static_eval >= beta) {
             return beta;
@@ -554,6 +1709,9 @@ int alphabeta(Position &pos,
     }
 
     const u64 tt_key = get_hash(pos);
+    assert(tt_key == get_hash(pos, false));
+    assert(pos.psqt == refreshed(pos).psqt && pos.phase == refreshed(pos).phase);
+    assert(pos.pawn_hash == refreshed(pos).pawn_hash);
 
     if (ply > 0 && !in_qsearch) {
         // Repetition detection
@@ -568,6 +1726,9 @@ int alphabeta(Position &pos,
             if (depth < 5) {
                 const int margins[] = {0, 50, 100, 200, 300};
                 if (static_eval - margins[depth - improving] >= beta) {
+                    // minify enable filter delete
+                    STAT(search_stats.reverse_futility_prunes++);
+                    // minify disable filter delete
                     return beta;
                 }
             }
@@ -576,6 +1737,13 @@ int alphabeta(Position &pos,
             if (depth > 2 && static_eval >= beta && do_null && pos.colour[0] & ~(pos.pieces[Pawn] | pos.pieces[King])) {
                 auto npos = pos;
                 flip(npos);
+                // minify enable filter delete
+                STAT(search_stats.null_tries++);
+                hash_ep(npos);
+                tt_prefetch(tt, npos.hash[0]);
+                stack[ply].current_move = no_move;
+                stack[ply].moved_piece = None;
+                // minify disable filter delete
                 npos.ep = 0;
                 if (-alphabeta(npos,
                                -beta,
@@ -589,8 +1757,15 @@ int alphabeta(Position &pos,
                                stop,
                                stack,
                                hh_table,
+                               // minify enable filter delete
+                               histories,
+                               tt,
+                               // minify disable filter delete
                                hash_history,
                                false) >= beta) {
+                    // minify enable filter delete
+                    STAT(search_stats.null_cutoffs++);
+                    // minify disable filter delete
                     return beta;
                 }
             }
@@ -598,11 +1773,22 @@ int alphabeta(Position &pos,
     }
 
     // TT Probing
-    TT_Entry &tt_entry = transposition_table[tt_key % num_tt_entries];
+    // minify enable filter delete
+    TT_Entry tt_entry{};
+    STAT(search_stats.tt_probes++);
+    const bool tt_hit = tt_probe(tt, tt_key, tt_entry);
+    STAT(search_stats.tt_hits += tt_hit);
+    // minify disable filter delete
+    // minify insert TT_Entry &tt_entry = transposition_table[tt_key % num_tt_entries];
+    // minify insert const bool tt_hit = tt_entry.key == tt_key;
     Move tt_move{};
-    if (tt_entry.key == tt_key) {
+    if (tt_hit) {
         tt_move = tt_entry.move;
         if (ply > 0 && tt_entry.depth >= depth) {
+            // minify enable filter delete
+            STAT(search_stats.tt_cutoffs += tt_entry.flag == 0 || (tt_entry.flag == 1 && tt_entry.score <= alpha) ||
+                                            (tt_entry.flag == 2 && tt_entry.score >= beta));
+            // minify disable filter delete
             if (tt_entry.flag == 0) {
                 return tt_entry.score;
             }
@@ -619,36 +1805,144 @@ int alphabeta(Position &pos,
         depth--;
     }
 
-    // Exit early if out of time
-    if (depth > 3 && (stop || now() >= stop_time)) {
+    // minify enable filter delete
+    if (--nodes_until_poll <= 0) {
+        nodes_until_poll = poll_nodes;
+        if (node_total && (*node_total += nodes - nodes_counted) >= limits.nodes) {
+            stop = true;
+        }
+        nodes_counted = nodes;
+        if (polls_clock && now() >= stop_time) {
+            stop = true;
+        }
+    }
+
+    // Exit early if out of time, at any depth as the flag is cheap to read
+    if (stop) {
         return 0;
     }
+    // minify disable filter delete
+    // Exit early if out of time
+    // minify insert if (depth > 3 && (stop || now() >= stop_time)) {
+        // minify insert return 0;
+    // minify insert }
 
     auto &moves = stack[ply].moves;
-    const int num_moves = movegen(pos, moves, in_qsearch);
+    int64_t move_scores[256];
+    // 4ku-mini generates and scores every move up front
+    // minify insert const int num_moves = movegen(pos, moves, in_qsearch);
 
     // Score moves
-    int64_t move_scores[256];
-    for (int j = 0; j < num_moves; ++j) {
-        const int capture = piece_on(pos, moves[j].to);
-        if (moves[j] == tt_move) {
-            move_scores[j] = 1LL << 62;
-        } else if (capture != None) {
-            move_scores[j] = ((capture + 1) * (1LL << 54)) - piece_on(pos, moves[j].from);
-        } else if (moves[j] == stack[ply].killer) {
-            move_scores[j] = 1LL << 50;
-        } else {
-            move_scores[j] = hh_table[pos.flipped][moves[j].from][moves[j].to];
+    // minify insert for (int j = 0; j < num_moves; ++j) {
+        // minify insert const int capture = piece_on(pos, moves[j].to);
+        // minify insert if (moves[j] == tt_move) {
+            // minify insert move_scores[j] = 1LL << 62;
+        // minify insert } else if (capture != None) {
+            // minify insert move_scores[j] = ((capture + 1) * (1LL << 54)) - piece_on(pos, moves[j].from);
+        // minify insert } else if (moves[j] == stack[ply].killer) {
+            // minify insert move_scores[j] = 1LL << 50;
+        // minify insert } else {
+            // minify insert move_scores[j] = hh_table[pos.flipped][moves[j].from][moves[j].to];
+        // minify insert }
+    // minify insert }
+    // minify enable filter delete
+
+    // The histories that follow on from the previous two moves
+    const int piece1 = ply > 0 ? stack[ply - 1].moved_piece : None;
+    const int to1 = ply > 0 ? stack[ply - 1].current_move.to : 0;
+    const auto cont1 = histories.continuation[0][piece1][to1];
+    const auto cont2 = histories.continuation[1][ply > 1 ? stack[ply - 2].moved_piece : None]
+                                               [ply > 1 ? stack[ply - 2].current_move.to : 0];
+    const Move counter_move = histories.counter_moves[piece1][to1];
+
+    // Staged move generation: the TT move, then captures and promotions, then the killer and the counter move, then the
+    // remaining quiets, then the captures that lose material. Each stage is appended to the move list once the previous
+    // one runs out, so a cutoff skips the rest. Quiescence never gets to the losing captures.
+    int num_moves = 0;
+    int stage = 0;
+    Move bad_captures[256];
+    int num_bad_captures = 0;
+    const auto next_stage = [&](const int i) {
+        for (; i == num_moves && stage < 5; ++stage) {
+            if (stage == 0) {
+                if (is_legal_move(pos, tt_move) && (!in_qsearch || is_noisy(pos, tt_move))) {
+                    moves[num_moves] = tt_move;
+                    move_scores[num_moves++] = 1LL << 62;
+                }
+            } else if (stage == 1) {
+                const int end = num_moves + movegen(pos, moves + num_moves, true);
+                for (int j = num_moves; j < end; ++j) {
+                    if (moves[j] == tt_move) {
+                        continue;
+                    }
+                    // En passant and quiet promotions go after the real captures
+                    const int capture = piece_on(pos, moves[j].to);
+                    if (capture != None && !see(pos, moves[j], 0)) {
+                        bad_captures[num_bad_captures++] = moves[j];
+                        continue;
+                    }
+                    if (capture == None) {
+                        move_scores[num_moves] = 1LL << 53;
+                    } else {
+                        const int piece = piece_on(pos, moves[j].from);
+                        move_scores[num_moves] = ((capture + 1) * (1LL << 54)) +
+                                                 histories.capture[piece][moves[j].to][capture] - piece;
+                    }
+                    moves[num_moves++] = moves[j];
+                }
+            } else if (stage == 2) {
+                const Move killer = stack[ply].killer;
+                if (!in_qsearch && !(killer == tt_move) && is_legal_move(pos, killer) &&
+                    !is_noisy(pos, killer)) {
+                    moves[num_moves] = killer;
+                    move_scores[num_moves++] = 1LL << 50;
+                }
+                if (!in_qsearch && !(counter_move == tt_move) && !(counter_move == killer) &&
+                    is_legal_move(pos, counter_move) && !is_noisy(pos, counter_move)) {
+                    moves[num_moves] = counter_move;
+                    move_scores[num_moves++] = 1LL << 49;
+                }
+            } else if (stage == 3 && !in_qsearch) {
+                const int end = num_moves + movegen_quiets(pos, moves + num_moves);
+                for (int j = num_moves; j < end; ++j) {
+                    if (moves[j] == tt_move || moves[j] == stack[ply].killer || moves[j] == counter_move) {
+                        continue;
+                    }
+                    const int piece = piece_on(pos, moves[j].from);
+                    move_scores[num_moves] = hh_table[pos.flipped][moves[j].from][moves[j].to] +
+                                             cont1[piece][moves[j].to] + cont2[piece][moves[j].to];
+                    moves[num_moves++] = moves[j];
+                }
+            } else if (stage == 4 && !in_qsearch) {
+                // Still MVV-LVA among themselves, but negative so they're told apart from the good captures
+                for (int j = 0; j < num_bad_captures; ++j) {
+                    const Move move = bad_captures[j];
+                    const int piece = piece_on(pos, move.from);
+                    const int capture = piece_on(pos, move.to);
+                    move_scores[num_moves] = ((capture + 1) * (1LL << 54)) +
+                                             histories.capture[piece][move.to][capture] - piece - (1LL << 60);
+                    moves[num_moves++] = move;
+                }
+            }
         }
-    }
+    };
+    // minify disable filter delete
 
     int num_moves_evaluated = 0;
     int num_quiets_evaluated = 0;
+    // minify enable filter delete
+    int num_captures_evaluated = 0;
+    // minify disable filter delete
     int best_score = -INF;
     Move best_move{};
     uint16_t tt_flag = 1;  // Alpha flag
     hash_history.emplace_back(tt_key);
-    for (int i = 0; i < num_moves; ++i) {
+    for (int i = 0;
+         // minify enable filter delete
+         next_stage(i),
+         // minify disable filter delete
+         i < num_moves;
+         ++i) {
         // Find best move remaining
         int best_move_index = i;
         for (int j = i; j < num_moves; ++j) {
@@ -663,8 +1957,18 @@ int alphabeta(Position &pos,
         moves[best_move_index] = moves[i];
         move_scores[best_move_index] = move_scores[i];
 
+        // minify enable filter delete
+        if (!ply && ((!root_moves.empty() && find(root_moves.begin(), root_moves.end(), move) == root_moves.end()) ||
+                     find(excluded_moves.begin(), excluded_moves.end(), move) != excluded_moves.end())) {
+            continue;
+        }
+        // minify disable filter delete
+
         // Delta pruning
         if (in_qsearch && !in_check && static_eval + 50 + max_material[piece_on(pos, move.to)] < alpha) {
+            // minify enable filter delete
+            STAT(search_stats.delta_prunes++);
+            // minify disable filter delete
             best_score = alpha;
             break;
         }
@@ -672,17 +1976,40 @@ int alphabeta(Position &pos,
         // Forward futility pruning
         if (!in_qsearch && !in_check && !(move == tt_move) &&
             static_eval + 150 * depth + max_material[piece_on(pos, move.to)] < alpha) {
+            // minify enable filter delete
+            STAT(search_stats.futility_prunes++);
+            // minify disable filter delete
             best_score = alpha;
             break;
         }
 
+        // minify enable filter delete
+        // SEE pruning, skip captures that lose more material than the remaining depth is likely to win back
+        if (!in_qsearch && !in_check && alpha == beta - 1 && num_moves_evaluated && depth < 7 &&
+            piece_on(pos, move.to) != None && best_move_score < 0 && !see(pos, move, -100 * depth)) {
+            STAT(search_stats.see_prunes++);
+            continue;
+        }
+        // minify disable filter delete
+
         auto npos = pos;
         if (!makemove(npos, move)) {
             continue;
         }
 
         // minify enable filter delete
+        // Fixed node searches end at the same point whatever the hardware, and nodes are counted here so none are
+        // started past the limit
+        if (nodes >= limits.nodes) {
+            // Unwind as on a timeout, a half searched node mustn't reach the TT
+            stop = true;
+            hash_history.pop_back();
+            return 0;
+        }
+        tt_prefetch(tt, npos.hash[0]);
         nodes++;
+        stack[ply].current_move = move;
+        stack[ply].moved_piece = piece_on(pos, move.from);
         // minify disable filter delete
 
         int score;
@@ -700,15 +2027,28 @@ int alphabeta(Position &pos,
                                stop,
                                stack,
                                hh_table,
+                               // minify enable filter delete
+                               histories,
+                               tt,
+                               // minify disable filter delete
                                hash_history);
         } else {
             // Late move reduction
-            int reduction = depth > 1 && num_moves_evaluated > 5 && piece_on(pos, move.to) == None
+            // minify enable filter delete
+            // Losing captures are reduced like quiets
+            const bool reducible = piece_on(pos, move.to) == None || best_move_score < 0;
+            // minify disable filter delete
+            // minify insert const bool reducible = piece_on(pos, move.to) == None;
+            int reduction = depth > 1 && num_moves_evaluated > 5 && reducible
                                 ? 1 + num_moves_evaluated / 16 + depth / 8 + (alpha == beta - 1) - improving +
                                       (hh_table[pos.flipped][move.from][move.to] < 0) -
                                       (hh_table[pos.flipped][move.from][move.to] > 0)
                                 : 0;
 
+            // minify enable filter delete
+            STAT(search_stats.lmr_searches += reduction > 0);
+            // minify disable filter delete
+
         zero_window:
             score = -alphabeta(npos,
                                -alpha - 1,
@@ -722,9 +2062,16 @@ int alphabeta(Position &pos,
                                stop,
                                stack,
                                hh_table,
+                               // minify enable filter delete
+                               histories,
+                               tt,
+                               // minify disable filter delete
                                hash_history);
 
             if (reduction > 0 && score > alpha) {
+                // minify enable filter delete
+                STAT(search_stats.lmr_researches++);
+                // minify disable filter delete
                 reduction = 0;
                 goto zero_window;
             }
@@ -735,16 +2082,31 @@ int alphabeta(Position &pos,
         }
 
         // Exit early if out of time
-        if (depth > 3 && (stop || now() >= stop_time)) {
+        // minify enable filter delete
+        if (stop) {
             hash_history.pop_back();
             return 0;
         }
+        // minify disable filter delete
+        // minify insert if (depth > 3 && (stop || now() >= stop_time)) {
+            // minify insert hash_history.pop_back();
+            // minify insert return 0;
+        // minify insert }
 
         num_moves_evaluated++;
+        // minify enable filter delete
+        STAT(search_stats.moves_searched += !in_qsearch);
+        STAT(search_stats.expanded_nodes += !in_qsearch && num_moves_evaluated == 1);
+        // minify disable filter delete
         if (piece_on(pos, move.to) == None) {
             stack[ply].quiets_evaluated[num_quiets_evaluated] = move;
             num_quiets_evaluated++;
         }
+        // minify enable filter delete
+        if (piece_on(pos, move.to) != None) {
+            stack[ply].captures_evaluated[num_captures_evaluated++] = move;
+        }
+        // minify disable filter delete
 
         if (score > best_score) {
             best_score = score;
@@ -757,26 +2119,66 @@ int alphabeta(Position &pos,
         } else if (!in_qsearch && !in_check && alpha == beta - 1 && depth <= 3 &&
                    num_moves_evaluated >= (depth * 3) + 2 && static_eval < alpha - (50 * depth) &&
                    best_move_score < (1LL << 50)) {
+            // minify enable filter delete
+            STAT(search_stats.lmp_prunes++);
+            // minify disable filter delete
             best_score = alpha;
             break;
         }
 
         if (alpha >= beta) {
+            // minify enable filter delete
+            STAT(search_stats.beta_cutoffs += !in_qsearch);
+            STAT(search_stats.first_move_cutoffs += !in_qsearch && num_moves_evaluated == 1);
+            // minify disable filter delete
             tt_flag = 2;  // Beta flag
             const int capture = piece_on(pos, move.to);
-            if (capture == None) {
-                hh_table[pos.flipped][move.from][move.to] += depth * depth;
-                for (int j = 0; j < num_quiets_evaluated - 1; ++j) {
-                    hh_table[pos.flipped][stack[ply].quiets_evaluated[j].from][stack[ply].quiets_evaluated[j].to] -=
-                        depth * depth;
+            // minify enable filter delete
+            // Quiet promotions can cut off in qsearch, but depth doesn't mean anything there to scale a bonus by
+            if (!in_qsearch) {
+                const int bonus = min(100 * depth, history_max / 4);
+                if (capture == None) {
+                    const int piece = piece_on(pos, move.from);
+                    update_history(hh_table[pos.flipped][move.from][move.to], bonus);
+                    update_history(cont1[piece][move.to], bonus);
+                    update_history(cont2[piece][move.to], bonus);
+                    for (int j = 0; j < num_quiets_evaluated - 1; ++j) {
+                        const Move quiet = stack[ply].quiets_evaluated[j];
+                        const int quiet_piece = piece_on(pos, quiet.from);
+                        update_history(hh_table[pos.flipped][quiet.from][quiet.to], -bonus);
+                        update_history(cont1[quiet_piece][quiet.to], -bonus);
+                        update_history(cont2[quiet_piece][quiet.to], -bonus);
+                    }
+                    stack[ply].killer = move;
+                    histories.counter_moves[piece1][to1] = move;
+                } else {
+                    update_history(histories.capture[piece_on(pos, move.from)][move.to][capture], bonus);
+                }
+                // The captures searched before the cutoff didn't cause it
+                for (int j = 0; j < num_captures_evaluated - (capture != None); ++j) {
+                    const Move other = stack[ply].captures_evaluated[j];
+                    update_history(histories.capture[piece_on(pos, other.from)][other.to][piece_on(pos, other.to)],
+                                   -bonus);
                 }
-                stack[ply].killer = move;
             }
+            // minify disable filter delete
+            // 4ku-mini only keeps the butterfly history, by depth squared, and the killer
+            // minify insert if (capture == None) {
+                // minify insert hh_table[pos.flipped][move.from][move.to] += depth * depth;
+                // minify insert for (int j = 0; j < num_quiets_evaluated - 1; ++j) {
+                    // minify insert hh_table[pos.flipped][stack[ply].quiets_evaluated[j].from][stack[ply].quiets_evaluated[j].to] -=
+                        // minify insert depth * depth;
+                // minify insert }
+                // minify insert stack[ply].killer = move;
+            // minify insert }
             break;
         }
 
         // Late move pruning based on quiet move count
         if (!in_check && alpha == beta - 1 && num_quiets_evaluated > 3 + 2 * depth * depth) {
+            // minify enable filter delete
+            STAT(search_stats.lmp_prunes++);
+            // minify disable filter delete
             break;
         }
     }
@@ -788,49 +2190,40 @@ int alphabeta(Position &pos,
     }
 
     // Save to TT
-    if (tt_entry.key != tt_key || depth >= tt_entry.depth || tt_flag == 0) {
-        tt_entry =
-            TT_Entry{tt_key, best_move == no_move ? tt_move : best_move, best_score, in_qsearch ? 0 : depth, tt_flag};
+    // minify enable filter delete
+    // The later MultiPV lines aren't the real root result, keep them out of the TT
+    if (ply == 0 && !excluded_moves.empty()) {
+        return alpha;
     }
+    tt_store(tt, tt_key, best_move == no_move ? tt_move : best_move, best_score, in_qsearch ? 0 : depth, tt_flag);
+    // minify disable filter delete
+    // minify insert if (tt_entry.key != tt_key || depth >= tt_entry.depth || tt_flag == 0) {
+        // minify insert tt_entry = TT_Entry{
+            // minify insert tt_key, best_move == no_move ? tt_move : best_move, best_score, in_qsearch ? 0 : depth, tt_flag};
+    // minify insert }
 
     return alpha;
 }
 
 // minify enable filter delete
-[[nodiscard]] bool is_pseudolegal_move(const Position &pos, const Move &move) {
-    Move moves[256];
-    const int num_moves = movegen(pos, moves, false);
-    for (int i = 0; i < num_moves; ++i) {
-        if (moves[i] == move) {
-            return true;
-        }
-    }
-    return false;
-}
-// minify disable filter delete
-
-// minify enable filter delete
-void print_pv(const Position &pos, const Move move, vector<u64> &hash_history) {
-    // Check move pseudolegality
-    if (!is_pseudolegal_move(pos, move)) {
+void print_pv(ostream &out, const TT_Table &tt, const Position &pos, const Move move, vector<u64> &hash_history) {
+    // Check move legality
+    if (!is_legal_move(pos, move)) {
         return;
     }
 
-    // Check move legality
     auto npos = pos;
-    if (!makemove(npos, move)) {
-        return;
-    }
+    makemove(npos, move);
 
     // Print current move
-    cout << " " << move_str(move, pos.flipped);
+    out << " " << move_str(move, pos.flipped);
 
     // Probe the TT in the resulting position
     const u64 tt_key = get_hash(npos);
-    const TT_Entry &tt_entry = transposition_table[tt_key % num_tt_entries];
+    TT_Entry tt_entry;
 
     // Only continue if the move was valid and comes from a PV search
-    if (tt_entry.key != tt_key || tt_entry.move == Move{} || tt_entry.flag != 0) {
+    if (!tt_probe(tt, tt_key, tt_entry) || tt_entry.move == Move{} || tt_entry.flag != 0) {
         return;
     }
 
@@ -842,106 +2235,403 @@ void print_pv(const Position &pos, const Move move, vector<u64> &hash_history) {
     }
 
     hash_history.emplace_back(tt_key);
-    print_pv(npos, tt_entry.move, hash_history);
+    print_pv(out, tt, npos, tt_entry.move, hash_history);
     hash_history.pop_back();
 }
 // minify disable filter delete
 
+// minify enable filter delete
+// Search state that lives on the heap and is reused from one search to the next, one per search thread
+struct [[nodiscard]] ThreadData {
+    Stack stack[128] = {};
+    int64_t hh_table[2][64][64] = {};
+    Histories histories = {};
+    // Nodes searched by the thread's last search, and the score and depth of its last completed iteration
+    int64_t nodes = 0;
+    int score = 0;
+    int depth = 0;
+    SearchStats stats;
+};
+
+vector<unique_ptr<ThreadData>> thread_data;
+// Searches print while the UCI thread answers isready, keep their lines whole
+mutex output_mutex;
+// Cleared by analyse, whose workers all search as thread 0 but leave stdout to their records
+bool print_info = true;
+// minify disable filter delete
+
 auto iteratively_deepen(Position &pos,
                         vector<u64> &hash_history,
                         // minify enable filter delete
-                        int thread_id,
-                        const bool is_bench,
+                        ThreadData &data,
+                        const int thread_id,
+                        const TT_Table &tt,
                         // minify disable filter delete
                         const int64_t start_time,
                         const int allocated_time,
-                        int &stop) {
-    Stack stack[128] = {};
-    int64_t hh_table[2][64][64] = {};
+                        StopFlag &stop) {
+    // minify enable filter delete
+    assert(is_refreshed(pos));
+    // History carries over between moves, the killers and PV are from a different root
+    Stack *const stack = data.stack;
+    auto &hh_table = data.hh_table;
+    auto &histories = data.histories;
+    for (int i = 0; i < 128; ++i) {
+        stack[i].move = stack[i].killer = no_move;
+    }
+    // minify disable filter delete
+    // minify insert Stack stack[128] = {};
+    // minify insert int64_t hh_table[2][64][64] = {};
     // minify enable filter delete
     int64_t nodes = 0;
+    STAT(search_stats = SearchStats());
+    Move best_move{};
+    int best_move_changes = 0;
+    int last_score = 0;
+    polls_clock = thread_id == 0;
+    nodes_until_poll = 0;
+    nodes_counted = 0;
+
+    // Only thread 0 reports the extra lines, and there can't be more of them than root moves
+    Move root_list[256];
+    int num_root_moves = movegen(pos, root_list, false);
+    if (!root_moves.empty()) {
+        num_root_moves = static_cast<int>(root_moves.size());
+    }
+    const int num_lines = thread_id == 0 ? max(1, min(multipv, num_root_moves)) : 1;
+    vector<Move> line_moves(num_lines);
+    vector<int> line_scores(num_lines);
     // minify disable filter delete
 
     int score = 0;
     for (int i = 1; i < 128; ++i) {
-        auto window = 40;
-        auto research = 0;
-    research:
-        const auto newscore = alphabeta(pos,
-                                        score - window,
-                                        score + window,
-                                        i,
-                                        0,
-                                        // minify enable filter delete
-                                        nodes,
-                                        // minify disable filter delete
-                                        start_time + allocated_time,
-                                        stop,
-                                        stack,
-                                        hh_table,
-                                        hash_history);
-
-        // Hard time limit exceeded
-        if (now() >= start_time + allocated_time || stop) {
-            break;
-        }
-
         // minify enable filter delete
-        if (thread_id == 0) {
-            const auto elapsed = now() - start_time;
-
-            cout << "info";
-            cout << " depth " << i;
-            cout << " score cp " << newscore;
-            if (newscore >= score + window) {
-                cout << " lowerbound";
-            } else if (newscore <= score - window) {
-                cout << " upperbound";
+        excluded_moves.clear();
+        int first_line_research = 0;
+        int line = 0;
+        for (; line < num_lines; ++line) {
+            // Each line keeps its own aspiration window centred on its score from the previous iteration
+            score = line_scores[line];
+            // minify disable filter delete
+            auto window = 40;
+            auto research = 0;
+        research:
+            const auto newscore = alphabeta(pos,
+                                            score - window,
+                                            score + window,
+                                            i,
+                                            0,
+                                            // minify enable filter delete
+                                            nodes,
+                                            // minify disable filter delete
+                                            start_time + allocated_time,
+                                            stop,
+                                            stack,
+                                            hh_table,
+                                            // minify enable filter delete
+                                            histories,
+                                            tt,
+                                            // minify disable filter delete
+                                            hash_history);
+
+            // Hard time limit exceeded
+            if (now() >= start_time + allocated_time || stop) {
+                break;
             }
-            cout << " time " << elapsed;
-            cout << " nodes " << nodes;
-            if (elapsed > 0) {
-                cout << " nps " << nodes * 1000 / elapsed;
+
+            // minify enable filter delete
+            if (thread_id == 0 && print_info) {
+                const lock_guard<mutex> lock(output_mutex);
+                const auto elapsed = now() - start_time;
+
+                cout << "info";
+                cout << " depth " << i;
+                if (num_lines > 1) {
+                    cout << " multipv " << line + 1;
+                }
+                cout << " score cp " << newscore;
+                if (newscore >= score + window) {
+                    cout << " lowerbound";
+                } else if (newscore <= score - window) {
+                    cout << " upperbound";
+                }
+                cout << " time " << elapsed;
+                cout << " nodes " << nodes;
+                if (elapsed > 0) {
+                    cout << " nps " << nodes * 1000 / elapsed;
+                }
+                // Not a lowerbound - a fail low won't have a meaningful PV.
+                if (newscore > score - window) {
+                    cout << " pv";
+                    print_pv(cout, tt, pos, stack[0].move, hash_history);
+                }
+                cout << endl;
             }
-            // Not a lowerbound - a fail low won't have a meaningful PV.
-            if (newscore > score - window) {
-                cout << " pv";
-                print_pv(pos, stack[0].move, hash_history);
+            // minify disable filter delete
+
+            if (newscore >= score + window || newscore <= score - window) {
+                window <<= ++research;
+                score = newscore;
+                goto research;
             }
-            cout << endl;
-
-            // OpenBench compliance
-            if (is_bench && i >= 12) {
-                cout << "Bench: ";
-                cout << elapsed << " ms ";
-                cout << nodes << " nodes ";
-                cout << nodes * 1000 / max(elapsed, static_cast<int64_t>(1)) << " nps";
-                cout << endl;
+
+            score = newscore;
+
+            // minify enable filter delete
+            line_scores[line] = newscore;
+            line_moves[line] = stack[0].move;
+            excluded_moves.push_back(stack[0].move);
+            if (line == 0) {
+                first_line_research = research;
+            }
+        }
+        excluded_moves.clear();
+
+        // An unfinished later line mustn't replace the best move found by the first one
+        if (line > 0) {
+            stack[0].move = line_moves[0];
+        }
+        if (line < num_lines) {
+            break;
+        }
+        score = line_scores[0];
+        data.score = score;
+        data.depth = i;
+
+        if (thread_id == 0) {
+            // Spend longer while the best move keeps changing or the score is falling, up to the hard limit
+            best_move_changes = best_move_changes / 2 + (stack[0].move == best_move ? 0 : 100);
+            best_move = stack[0].move;
+            const int score_drop = i > 1 ? clamp(last_score - score, 0, 100) : 0;
+            last_score = score;
+            const int64_t soft_time = int64_t{limits.soft_time} * (100 + best_move_changes / 2 + score_drop) / 100;
+            if (i >= limits.depth ||
+                (!first_line_research && now() >= start_time + min<int64_t>(soft_time, allocated_time))) {
                 break;
             }
         }
         // minify disable filter delete
+        // Early exit after completed ply
+        // minify insert if (!research && now() >= start_time + allocated_time / 10) {
+            // minify insert break;
+        // minify insert }
+    }
 
-        if (newscore >= score + window || newscore <= score - window) {
-            window <<= ++research;
-            score = newscore;
-            goto research;
+    // minify enable filter delete
+    data.nodes = nodes;
+    STAT(data.stats = search_stats);
+    // minify disable filter delete
+    return stack[0].move;
+}
+
+// minify enable filter delete
+// Lazy SMP helpers are started once and sleep on a condition variable between searches
+vector<thread> helpers;
+// Raised by stop, by thread 0 once it's done, or when time runs out, every search thread watches it
+atomic<int> search_stop{false};
+mutex helpers_mutex;
+condition_variable helpers_cv;
+// The search the helpers should run next, they pick it up when search_id changes
+struct [[nodiscard]] HelperJob {
+    Position pos;
+    vector<u64> hash_history;
+    int64_t start_time;
+} helper_job;
+int search_id = 0;
+int helpers_searching = 0;
+bool helpers_quit = false;
+
+void helper_loop(const int thread_id, int last_search_id) {
+    node_total = &pool_nodes;
+    while (true) {
+        unique_lock<mutex> lock(helpers_mutex);
+        helpers_cv.wait(lock, [&]() {
+            return helpers_quit || search_id != last_search_id;
+        });
+        if (helpers_quit) {
+            return;
+        }
+        last_search_id = search_id;
+        auto job = helper_job;
+        lock.unlock();
+
+        iteratively_deepen(job.pos,
+                           job.hash_history,
+                           *thread_data[thread_id],
+                           thread_id,
+                           shared_tt(),
+                           job.start_time,
+                           1 << 30,
+                           search_stop);
+
+        lock.lock();
+        if (!--helpers_searching) {
+            helpers_cv.notify_all();
+        }
+    }
+}
+
+void resize_threads(const int count) {
+    {
+        lock_guard<mutex> lock(helpers_mutex);
+        helpers_quit = true;
+    }
+    helpers_cv.notify_all();
+    for (auto &helper : helpers) {
+        helper.join();
+    }
+    helpers.clear();
+    helpers_quit = false;
+
+    thread_count = count;
+    while (static_cast<int>(thread_data.size()) < count) {
+        thread_data.emplace_back(make_unique<ThreadData>());
+    }
+    thread_data.resize(count);
+    for (int i = 1; i < count; ++i) {
+        helpers.emplace_back(helper_loop, i, search_id);
+    }
+}
+
+// Every thread's statistics from the last search added up
+[[nodiscard]] SearchStats gather_stats() {
+    SearchStats total;
+    for (const auto &data : thread_data) {
+        add_stats(total, data->stats);
+    }
+    return total;
+}
+
+void start_helpers(const Position &pos, const vector<u64> &hash_history, const int64_t start_time) {
+    {
+        lock_guard<mutex> lock(helpers_mutex);
+        helper_job = {pos, hash_history, start_time};
+        helpers_searching = thread_count - 1;
+        search_id++;
+    }
+    helpers_cv.notify_all();
+}
+
+void stop_helpers() {
+    unique_lock<mutex> lock(helpers_mutex);
+    search_stop = true;
+    helpers_cv.wait(lock, []() {
+        return !helpers_searching;
+    });
+}
+
+// Thread 0 searches on a thread of its own so the UCI thread is free to handle stop and ponderhit meanwhile. Like the
+// helpers it's started once and sleeps between searches, so its thread_local tables carry over from move to move.
+thread search_thread;
+mutex search_mutex;
+condition_variable search_cv;
+struct [[nodiscard]] SearchJob {
+    Position pos;
+    vector<u64> hash_history;
+    int64_t start_time;
+    int allocated_time;
+} search_job;
+bool search_pending = false;
+bool search_running = false;
+bool search_quit = false;
+// go infinite and go ponder hold their bestmove back until stop or ponderhit
+atomic<int> search_hold{false};
+// Set by ponderhit, the ponder search then ends without a bestmove and a timed search takes over
+atomic<int> search_silent{false};
+// The timed limits to switch to after a ponderhit
+SearchLimits ponder_limits;
+
+void search_root(Position pos, vector<u64> hash_history, const int64_t start_time, const int allocated_time) {
+    start_helpers(pos, hash_history, start_time);
+    auto best_move =
+        iteratively_deepen(pos, hash_history, *thread_data[0], 0, shared_tt(), start_time, allocated_time, search_stop);
+    // Stopped before the first iteration found anything, any legal move beats an illegal one
+    if (best_move == no_move) {
+        Move moves[256];
+        if (movegen(pos, moves, false)) {
+            best_move = moves[0];
         }
+    }
+    // A search that ran out of depth still mustn't answer before it's allowed to
+    while (search_hold && !search_stop) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    stop_helpers();
 
-        score = newscore;
+    if (!search_silent) {
+        const lock_guard<mutex> lock(output_mutex);
+        STAT(print_stats(gather_stats()));
+        cout << "bestmove " << move_str(best_move, pos.flipped) << endl;
+    }
+}
 
-        // Early exit after completed ply
-        if (!research && now() >= start_time + allocated_time / 10) {
-            break;
+void search_loop() {
+    node_total = &pool_nodes;
+    unique_lock<mutex> lock(search_mutex);
+    while (true) {
+        search_cv.wait(lock, []() {
+            return search_quit || search_pending;
+        });
+        if (search_quit) {
+            return;
         }
+        search_pending = false;
+        auto job = search_job;
+        lock.unlock();
+
+        search_root(job.pos, job.hash_history, job.start_time, job.allocated_time);
+
+        lock.lock();
+        search_running = false;
+        search_cv.notify_all();
+    }
+}
+
+void start_search(const Position &pos,
+                  const vector<u64> &hash_history,
+                  const SearchLimits &search_limits,
+                  const bool hold) {
+    limits = search_limits;
+    tt_generation = tt_generation % 63 + 1;
+    pool_nodes = 0;
+    search_stop = false;
+    search_hold = hold;
+    search_silent = false;
+    if (!search_thread.joinable()) {
+        search_thread = thread(search_loop);
+    }
+    {
+        const lock_guard<mutex> lock(search_mutex);
+        search_job = {pos, hash_history, now(), limits.hard_time};
+        search_pending = search_running = true;
+    }
+    search_cv.notify_all();
+}
+
+void wait_for_search() {
+    unique_lock<mutex> lock(search_mutex);
+    search_cv.wait(lock, []() {
+        return !search_running;
+    });
+}
+
+void stop_search() {
+    search_hold = false;
+    search_stop = true;
+    wait_for_search();
+}
+
+void clear_histories() {
+    for (auto &data : thread_data) {
+        memset(data->hh_table, 0, sizeof(data->hh_table));
+        memset(static_cast<void *>(&data->histories), 0, sizeof(data->histories));
     }
-    return stack[0].move;
 }
 
-// minify enable filter delete
 void set_fen(Position &pos, const string &fen) {
     if (fen == "startpos") {
         pos = Position();
+        pos = refreshed(pos);
         return;
     }
 
@@ -949,6 +2639,7 @@ void set_fen(Position &pos, const string &fen) {
     pos.colour = {};
     pos.pieces = {};
     pos.castling = {};
+    pos.board.fill(None);
 
     stringstream ss{fen};
     string word;
@@ -970,6 +2661,7 @@ void set_fen(Position &pos, const string &fen) {
                                                        : King;
             pos.colour.at(side) ^= 1ULL << i;
             pos.pieces.at(piece) ^= 1ULL << i;
+            pos.board.at(i) = static_cast<uint8_t>(piece);
             i++;
         }
     }
@@ -998,6 +2690,463 @@ void set_fen(Position &pos, const string &fen) {
     if (black_move) {
         flip(pos);
     }
+
+    pos = refreshed(pos);
+}
+
+// Opening, middlegame and endgame positions, the node total over all of them is the bench signature
+const char *const bench_fens[] = {
+    "startpos",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1bq1rk1/ppp1nppp/4n3/3p3Q/3P4/1BP1B3/PP1N2PP/R4RK1 w - - 1 16",
+    "4r1k1/r1q2ppp/ppp2n2/4P3/5Rb1/1N1BQ3/PPP3PP/R5K1 w - - 1 17",
+    "2rqkb1r/ppp2p2/2npb1p1/1N1Nn2p/2P1PP2/8/PP2B1PP/R1BQK2R b KQ - 0 11",
+    "r1bq1r1k/b1p1npp1/p2p3p/1p6/3PP3/1B2NN2/PP3PPP/R2Q1RK1 w - - 1 16",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "r1q2rk1/2p1bppp/2Pp4/p6b/Q1PNp3/4B3/PP1R1PPP/2K4R w - - 2 18",
+    "4k2r/1pb2ppp/1p2p3/1R1p4/3P4/2r1PN2/P4PPP/1R4K1 b - - 3 22",
+    "3q2k1/pb3p1p/4pbp1/2r5/PpN2N2/1P2P2P/5PP1/Q2R2K1 b - - 4 26",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/3N4 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+    "2K5/p7/7P/5pR1/8/5k2/r7/8 w - - 0 1",
+    "8/6pk/1p6/8/PP3p1p/5P2/4KP1q/3Q4 w - - 0 1",
+    "7k/3p2pp/4q3/8/4Q3/5Kp1/P6b/8 w - - 0 1",
+    "8/2p5/8/2kPKp1p/2p4P/2P5/3P4/8 w - - 0 1",
+    "8/1p3pp1/7p/5P1P/2k3P1/8/2K2P2/8 w - - 0 1",
+    "8/pp2r1k1/2p1p3/3pP2p/1P1P1P1P/P5KR/8/8 w - - 0 1",
+    "8/3p4/p1bk3p/Pp6/1Kp1PpPp/2P2P1P/2P5/5B2 b - - 0 1",
+    "5k2/7R/4P2p/5K2/p1r2P1p/8/8/8 b - - 0 1",
+    "6k1/6p1/P6p/r1N5/5p2/7P/1b3PP1/4R1K1 w - - 0 1",
+    "1r3k2/4q3/2Pp3b/3Bp3/2Q2p2/1p1P2P1/1P2KP2/3N4 w - - 0 1",
+    "6k1/4pp1p/3p2p1/P1pPb3/R7/1r2P1PP/3B1P2/6K1 w - - 0 1",
+    "8/3p3B/5p2/5P2/p7/PP5b/k7/6K1 w - - 0 1",
+    "5rk1/q6p/2p3bR/1pPp1rP1/1P1Pp3/P3B1Q1/1K3P2/R7 w - - 93 90",
+    "4rrk1/1p1nq3/p7/2p1P1pp/3P2bp/3Q1Bn1/PPPB4/1K2R1NR w - - 40 21",
+    "r3k2r/3nnpbp/q2pp1p1/p7/Pp1PPPP1/4BNN1/1P5P/R2Q1RK1 w kq - 0 16",
+    "3Qb1k1/1r2ppb1/pN1n2q1/Pp1Pp1Pr/4P2p/4BP2/4B1R1/1R5K b - - 11 40",
+    "4k3/3q1r2/1N2r1b1/3ppN2/2nPP3/1B1R2n1/2R1Q3/3K4 w - - 5 1",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1",
+    "8/8/8/5N2/8/p7/8/2NK3k w - - 0 1",
+    "8/3k4/8/8/8/4B3/4KB2/2B5 w - - 0 1",
+    "8/8/1P6/5pr1/8/4R3/7k/2K5 w - - 0 1",
+    "8/2p4P/8/kr6/6R1/8/8/1K6 w - - 0 1",
+    "8/8/3P3k/8/1p6/8/1P6/1K3n2 b - - 0 1",
+    "8/R7/2q5/8/6k1/8/1P5p/K6R w - - 0 124",
+    "6k1/3b3r/1p1p4/p1n2p2/1PPNpP1q/P3Q1p1/1R1RB1P1/5K2 b - - 0 1",
+    "r2r1n2/pp2bk2/2p1p2p/3q4/3PN1QP/2P3R1/P4PP1/5RK1 w - - 0 1",
+    "r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP1B1PPP/R2QKB1R w KQ - 0 8",
+    "r2q1rk1/1p1nbppp/p2pbn2/4p3/4P3/1NN1BP2/PPPQ2PP/2KR1B1R w - - 0 11",
+    "r1b1k2r/ppppnppp/2n2q2/2b5/3NP3/2P1B3/PP3PPP/RN1QKB1R w KQkq - 0 7",
+    "2r3k1/pp3ppp/2n1p3/3pP3/3P4/P1R2N2/1P3PPP/6K1 b - - 0 25",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+    "r1bq1rk1/pp2ppbp/2np1np1/8/3NP3/2N1BP2/PPPQ2PP/R3KB1R w KQ - 3 9",
+};
+
+// A whole number from the command line, clamped into range. Anything else is rejected rather than read as 0.
+[[nodiscard]] bool parse_arg(const char *const arg, const int64_t lowest, const int64_t highest, int64_t &value) {
+    char *end;
+    const long long number = strtoll(arg, &end, 10);
+    if (end == arg || *end) {
+        return false;
+    }
+    value = clamp<int64_t>(number, lowest, highest);
+    return true;
+}
+
+// OpenBench compliance: bench [depth] [threads] [hash]. Every position is searched to the same depth from a cleared TT
+// and histories, so with one thread the node total only changes when the search does.
+void bench(const int depth, const int threads, const int hash) {
+    resize_threads(threads);
+    num_tt_buckets = static_cast<u64>(hash) * 1024 * 1024 / sizeof(TT_Bucket);
+    tt_resize();
+    limits = SearchLimits();
+    limits.depth = depth;
+
+    const int num_fens = static_cast<int>(sizeof(bench_fens) / sizeof(bench_fens[0]));
+    int64_t total_nodes = 0;
+    int64_t total_time = 0;
+    [[maybe_unused]] SearchStats total_stats;
+    for (int i = 0; i < num_fens; ++i) {
+        Position pos;
+        set_fen(pos, bench_fens[i]);
+        vector<u64> hash_history;
+        tt_clear();
+        clear_histories();
+        search_stop = false;
+
+        const auto start_time = now();
+        start_helpers(pos, hash_history, start_time);
+        iteratively_deepen(pos, hash_history, *thread_data[0], 0, shared_tt(), start_time, 1 << 30, search_stop);
+        stop_helpers();
+        const auto elapsed = now() - start_time;
+
+        int64_t nodes = 0;
+        for (const auto &data : thread_data) {
+            nodes += data->nodes;
+        }
+        STAT(add_stats(total_stats, gather_stats()));
+        total_nodes += nodes;
+        total_time += elapsed;
+        cout << "Position " << i + 1 << "/" << num_fens << ": ";
+        cout << nodes << " nodes ";
+        cout << nodes * 1000 / max(elapsed, static_cast<int64_t>(1)) << " nps";
+        cout << endl;
+    }
+
+    STAT(print_stats(total_stats));
+    cout << "Bench: ";
+    cout << total_time << " ms ";
+    cout << total_nodes << " nodes ";
+    cout << total_nodes * 1000 / max(total_time, static_cast<int64_t>(1)) << " nps";
+    cout << endl;
+}
+
+// Perft counts the leaves of the legal move tree, checking movegen() and makemove() against known totals and timing
+// them. The full build only generates legal moves, so the last ply is counted without being made.
+struct [[nodiscard]] PerftEntry {
+    // The key xor the data, a torn write from another thread then just fails to match
+    u64 check;
+    // Leaf count above the depth in the low byte
+    u64 data;
+};
+
+vector<PerftEntry> perft_table;
+
+[[nodiscard]] u64 perft(const Position &pos, const int depth) {
+    Move moves[256];
+    const int num_moves = movegen(pos, moves, false);
+    if (depth <= 1) {
+        return num_moves;
+    }
+
+    PerftEntry *entry = nullptr;
+    const u64 key = get_hash(pos);
+    if (!perft_table.empty()) {
+        entry = &perft_table[static_cast<size_t>(static_cast<unsigned __int128>(key) * perft_table.size() >> 64)];
+        const u64 data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+        if ((__atomic_load_n(&entry->check, __ATOMIC_RELAXED) ^ data) == key && (data & 255) == u64(depth)) {
+            return data >> 8;
+        }
+    }
+
+    u64 nodes = 0;
+    for (int i = 0; i < num_moves; ++i) {
+        auto npos = pos;
+        makemove(npos, moves[i]);
+        nodes += perft(npos, depth - 1);
+    }
+
+    if (entry) {
+        const u64 data = nodes << 8 | u64(depth);
+        __atomic_store_n(&entry->check, key ^ data, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+    }
+    return nodes;
+}
+
+// perft <depth> [hash <MB>] [threads <count>], printing the leaves under each root move. The root moves are shared out
+// between the threads, which all use the same hash table.
+void perft_divide(const Position &pos, stringstream &ss) {
+    assert(is_refreshed(pos));
+    int depth = 1;
+    int hash = 0;
+    int threads = thread_count;
+    string word;
+    ss >> depth;
+    while (ss >> word) {
+        if (word == "hash") {
+            ss >> hash;
+        } else if (word == "threads") {
+            ss >> threads;
+        }
+    }
+    depth = max(1, min(63, depth));
+    threads = max(1, min(256, threads));
+    perft_table.assign(static_cast<size_t>(max(0, hash)) * 1024 * 1024 / sizeof(PerftEntry), PerftEntry{});
+
+    Move moves[256];
+    const int num_moves = movegen(pos, moves, false);
+    vector<u64> counts(num_moves);
+    atomic<int> next_move{0};
+    const auto worker = [&]() {
+        for (int i; (i = next_move++) < num_moves;) {
+            auto npos = pos;
+            makemove(npos, moves[i]);
+            counts[i] = depth > 1 ? perft(npos, depth - 1) : 1;
+        }
+    };
+
+    const auto start_time = now();
+    vector<thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &w : workers) {
+        w.join();
+    }
+    const auto elapsed = now() - start_time;
+
+    u64 total = 0;
+    for (int i = 0; i < num_moves; ++i) {
+        cout << move_str(moves[i], pos.flipped) << ": " << counts[i] << "\n";
+        total += counts[i];
+    }
+    cout << "Perft: ";
+    cout << elapsed << " ms ";
+    cout << total << " nodes ";
+    cout << total * 1000 / static_cast<u64>(max(elapsed, static_cast<int64_t>(1))) << " nps";
+    cout << endl;
+
+    perft_table.clear();
+    perft_table.shrink_to_fit();
+}
+
+// set_fen trusts its input, so check an EPD line first: the four position fields, eight ranks of eight squares, one
+// king a side and nothing set_fen would shift out of the board.
+[[nodiscard]] bool valid_fen(const string &fen) {
+    stringstream ss{fen};
+    string board;
+    string side;
+    string castling;
+    string ep;
+    if (!(ss >> board >> side >> castling >> ep)) {
+        return false;
+    }
+
+    int rank = 0;
+    int file = 0;
+    int kings[2] = {};
+    for (const auto c : board) {
+        if (c == '/') {
+            if (file != 8) {
+                return false;
+            }
+            rank++;
+            file = 0;
+        } else if (c >= '1' && c <= '8') {
+            file += c - '0';
+        } else if (c && strchr("pnbrqkPNBRQK", c)) {
+            kings[0] += c == 'K';
+            kings[1] += c == 'k';
+            file++;
+        } else {
+            return false;
+        }
+        if (file > 8) {
+            return false;
+        }
+    }
+    if (rank != 7 || file != 8 || kings[0] != 1 || kings[1] != 1) {
+        return false;
+    }
+
+    if (side != "w" && side != "b") {
+        return false;
+    }
+    if (castling != "-" && castling.find_first_not_of("KQkq") != string::npos) {
+        return false;
+    }
+    return ep == "-" || (ep.size() == 2 && ep[0] >= 'a' && ep[0] <= 'h' && (ep[1] == '3' || ep[1] == '6'));
+}
+
+// analyse <file> [--depth N] [--nodes N] [--threads N] [--hash MB] [--format jsonl|csv] searches every position of an
+// EPD file, running one single threaded search per thread rather than sharing each search between them. Every worker
+// has its own TT, histories and pawn table, so they share nothing but the input and stdout. Like the moves of a game,
+// each worker's positions age out the TT entries of the ones before rather than clearing the table, and the histories
+// carry over. Records are written as the searches finish, carrying their line number in the file, and the totals go to
+// stderr. A line that isn't a valid position gets an error record and isn't searched.
+[[nodiscard]] bool analyse(const int argc, const char **argv) {
+    string path;
+    int64_t threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+    int64_t hash = 16;
+    bool csv = false;
+    limits = SearchLimits();
+    int64_t depth = 0;
+    bool ok = true;
+    for (int i = 2; i < argc && ok; ++i) {
+        const string arg = argv[i];
+        if (arg == "--depth" && i + 1 < argc) {
+            ok = parse_arg(argv[++i], 1, 127, depth);
+        } else if (arg == "--nodes" && i + 1 < argc) {
+            ok = parse_arg(argv[++i], 1, INT64_MAX, limits.nodes);
+        } else if (arg == "--threads" && i + 1 < argc) {
+            ok = parse_arg(argv[++i], 1, 256, threads);
+        } else if (arg == "--hash" && i + 1 < argc) {
+            ok = parse_arg(argv[++i], 1, 65536, hash);
+        } else if (arg == "--format" && i + 1 < argc) {
+            csv = argv[++i] == string("csv");
+            ok = csv || argv[i] == string("jsonl");
+        } else {
+            ok = path.empty() && arg[0] != '-';
+            path = arg;
+        }
+    }
+    if (!ok || path.empty()) {
+        cerr << "Usage: 4ku analyse <file.epd> [--depth 1-127] [--nodes N] [--threads 1-256] [--hash MB 1-65536] "
+                "[--format jsonl|csv]"
+             << endl;
+        return false;
+    }
+    limits.depth = depth ? static_cast<int>(depth) : limits.nodes == INT64_MAX ? 10 : 127;
+
+    FILE *const file = fopen(path.c_str(), "rb");
+    if (!file) {
+        cerr << "Can't open " << path << endl;
+        return false;
+    }
+    string contents;
+    const char *text = nullptr;
+    size_t size = 0;
+#ifdef __linux__
+    // Map the file rather than reading it, so it's only paged in as the workers reach each line
+    struct stat st;
+    void *const mapping = fstat(fileno(file), &st) || st.st_size <= 0
+                              ? MAP_FAILED
+                              : mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (mapping != MAP_FAILED) {
+        madvise(mapping, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+        text = static_cast<const char *>(mapping);
+        size = static_cast<size_t>(st.st_size);
+    }
+#endif
+    // Pipes can't be mapped, read those instead
+    if (!text) {
+        char buffer[1 << 16];
+        for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file));) {
+            contents.append(buffer, n);
+        }
+        text = contents.data();
+        size = contents.size();
+    }
+    fclose(file);
+
+    // Finding a newline is nothing next to a search, so the lines are simply handed out under a lock
+    mutex input_mutex;
+    size_t offset = 0;
+    int64_t line_number = 0;
+    atomic<int64_t> total_positions{0};
+    atomic<int64_t> total_nodes{0};
+    print_info = false;
+    if (csv) {
+        puts("line,fen,bestmove,score,depth,nodes,pv");
+    }
+
+    const auto worker = [&]() {
+        vector<TT_Bucket> buckets(static_cast<size_t>(hash) * 1024 * 1024 / sizeof(TT_Bucket));
+        TT_Table tt = {buckets.data(), buckets.size(), 1};
+        const auto data = make_unique<ThreadData>();
+        atomic<int> stop{false};
+        while (true) {
+            string line;
+            int64_t number;
+            {
+                const lock_guard<mutex> lock(input_mutex);
+                if (offset >= size) {
+                    break;
+                }
+                const char *const begin = text + offset;
+                const auto end = static_cast<const char *>(memchr(begin, '\n', size - offset));
+                const size_t length = end ? static_cast<size_t>(end - begin) : size - offset;
+                line.assign(begin, length);
+                offset += length + 1;
+                number = ++line_number;
+            }
+
+            // The position is the first four fields, any EPD operations after them are ignored
+            stringstream ss{line};
+            string fen;
+            string word;
+            for (int i = 0; i < 4 && ss >> word; ++i) {
+                fen += (i ? " " : "") + word;
+            }
+            if (fen.empty() || fen[0] == '#') {
+                continue;
+            }
+            if (!valid_fen(fen)) {
+                // Still one record per line, but the FEN isn't echoed, it might not even be safe to quote
+                const string out = csv ? to_string(number) + ",,,,,,\n"
+                                       : "{\"line\":" + to_string(number) + ",\"error\":\"invalid FEN\"}\n";
+                const lock_guard<mutex> lock(output_mutex);
+                fwrite(out.data(), 1, out.size(), stdout);
+                cerr << "Line " << number << ": invalid FEN" << endl;
+                continue;
+            }
+            Position pos;
+            set_fen(pos, fen);
+            assert(is_refreshed(pos));
+            vector<u64> hash_history;
+
+            Move moves[256];
+            string move = "0000";
+            string pv_moves;
+            data->nodes = data->score = data->depth = 0;
+            if (movegen(pos, moves, false)) {
+                tt.generation = tt.generation % 63 + 1;
+                stop = false;
+                auto best_move = iteratively_deepen(pos, hash_history, *data, 0, tt, now(), 1 << 30, stop);
+                // Only possible if the node limit hit before the first iteration finished
+                if (best_move == no_move) {
+                    best_move = moves[0];
+                }
+                move = move_str(best_move, pos.flipped);
+                ostringstream pv;
+                print_pv(pv, tt, pos, best_move, hash_history);
+                pv_moves = pv.str().empty() ? move : pv.str().substr(1);
+            } else {
+                // Checkmate or stalemate, there's nothing to search
+                data->score = attacked(pos, lsb(pos.colour[0] & pos.pieces[King])) ? -MATE_SCORE : 0;
+            }
+
+            ostringstream record;
+            if (csv) {
+                record << number << "," << fen << "," << move << "," << data->score << "," << data->depth << ","
+                       << data->nodes << "," << pv_moves << "\n";
+            } else {
+                record << "{\"line\":" << number << ",\"fen\":\"" << fen << "\",\"bestmove\":\"" << move
+                       << "\",\"score\":" << data->score << ",\"depth\":" << data->depth << ",\"nodes\":" << data->nodes
+                       << ",\"pv\":\"" << pv_moves << "\"}\n";
+            }
+            const string out = record.str();
+            {
+                const lock_guard<mutex> lock(output_mutex);
+                fwrite(out.data(), 1, out.size(), stdout);
+            }
+            total_positions++;
+            total_nodes += data->nodes;
+        }
+    };
+
+    const auto start_time = now();
+    vector<thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &w : workers) {
+        w.join();
+    }
+    const auto elapsed = now() - start_time;
+    print_info = true;
+#ifdef __linux__
+    if (mapping != MAP_FAILED) {
+        munmap(mapping, size);
+    }
+#endif
+
+    cerr << "Analyse: ";
+    cerr << elapsed << " ms ";
+    cerr << total_positions << " positions ";
+    cerr << total_nodes << " nodes ";
+    cerr << total_nodes * 1000 / max(elapsed, static_cast<int64_t>(1)) << " nps";
+    cerr << endl;
+    return true;
 }
 // minify disable filter delete
 
@@ -1009,20 +3158,44 @@ int main(
 ) {
     setbuf(stdout, 0);
     Position pos;
+    // minify enable filter delete
+    pos = refreshed(pos);
+    resize_threads(thread_count);
+    // minify disable filter delete
     vector<u64> hash_history;
     Move moves[256];
 
     // minify enable filter delete
     // OpenBench compliance
     if (argc > 1 && argv[1] == string("bench")) {
-        // Initialise the TT
-        transposition_table.resize(num_tt_entries);
-
-        int stop = false;
-        iteratively_deepen(pos, hash_history, 0, true, now(), 1 << 30, stop);
-
+        // Depth, threads and hash in MB, with the same limits as go depth and the UCI options
+        int64_t args[3] = {12, 1, static_cast<int64_t>(num_tt_buckets * sizeof(TT_Bucket) >> 20)};
+        const int64_t highest[3] = {127, 256, 65536};
+        for (int i = 2; i < argc; ++i) {
+            if (i > 4 || !parse_arg(argv[i], 1, highest[i - 2], args[i - 2])) {
+                cerr << "Usage: 4ku bench [depth 1-127] [threads 1-256] [hash MB 1-65536]" << endl;
+                return 1;
+            }
+        }
+        bench(static_cast<int>(args[0]), static_cast<int>(args[1]), static_cast<int>(args[2]));
+        resize_threads(1);
+        return 0;
+    }
+    if (argc > 1 && argv[1] == string("perft")) {
+        string args;
+        for (int i = 2; i < argc; ++i) {
+            args += string(argv[i]) + " ";
+        }
+        stringstream ss{args};
+        perft_divide(pos, ss);
+        resize_threads(1);
         return 0;
     }
+    if (argc > 1 && argv[1] == string("analyse")) {
+        const bool ok = analyse(argc, argv);
+        resize_threads(1);
+        return ok ? 0 : 1;
+    }
     // minify disable filter delete
 
     string word;
@@ -1035,15 +3208,32 @@ int main(
     puts("id author kz04px");
     // minify enable filter delete
     cout << "option name Threads type spin default " << thread_count << " min 1 max 256\n";
-    cout << "option name Hash type spin default " << (num_tt_entries >> 15) << " min 1 max 65536\n";
+    cout << "option name Hash type spin default " << (num_tt_buckets >> 14) << " min 1 max 65536\n";
+    cout << "option name PawnHash type spin default " << (num_pawn_entries >> 15) << " min 1 max 1024\n";
+    cout << "option name PollNodes type spin default " << poll_nodes << " min 1 max 1048576\n";
+    cout << "option name MultiPV type spin default " << multipv << " min 1 max 256\n";
+    cout << "option name HashFile type string default " << tt_file << "\n";
+    cout << "option name SaveHash type button\n";
+    cout << "option name LoadHash type button\n";
     // minify disable filter delete
     puts("uciok");
 
     // Initialise the TT
-    transposition_table.resize(num_tt_entries);
+    // minify enable filter delete
+    tt_resize();
+    // minify disable filter delete
+    // minify insert transposition_table.resize(num_tt_entries);
 
     while (true) {
         cin >> word;
+        // minify enable filter delete
+        // Only these are handled mid-search, anything else waits for the search to finish as the GUI sends stop first
+        if (word == "quit" || !cin.good() || word == "stop") {
+            stop_search();
+        } else if (word != "isready" && word != "ponderhit") {
+            wait_for_search();
+        }
+        // minify disable filter delete
         if (word == "quit"
             // minify enable filter delete
             || !cin.good()
@@ -1051,73 +3241,168 @@ int main(
         ) {
             break;
         } else if (word == "ucinewgame") {
-            memset(transposition_table.data(), 0, sizeof(TT_Entry) * transposition_table.size());
+            // minify enable filter delete
+            tt_clear();
+            clear_histories();
+            // minify disable filter delete
+            // minify insert memset(transposition_table.data(), 0, sizeof(TT_Entry) * transposition_table.size());
         } else if (word == "isready") {
+            // minify enable filter delete
+            const lock_guard<mutex> lock(output_mutex);
+            // minify disable filter delete
             puts("readyok");
         }
         // minify enable filter delete
-        else if (word == "setoption") {
+        else if (word == "perft") {
+            string line;
+            getline(cin, line);
+            stringstream ss{line};
+            perft_divide(pos, ss);
+        } else if (word == "ponderhit") {
+            // The TT keeps what the ponder search found, so a fresh timed search catches up with it quickly
+            search_silent = true;
+            stop_search();
+            start_search(pos, hash_history, ponder_limits, false);
+        } else if (word == "setoption") {
             cin >> word;
             cin >> word;
             if (word == "Threads") {
                 cin >> word;
                 cin >> thread_count;
-                thread_count = max(1, min(256, thread_count));
+                resize_threads(max(1, min(256, thread_count)));
             } else if (word == "Hash") {
                 cin >> word;
-                cin >> num_tt_entries;
-                num_tt_entries = min(max(num_tt_entries, 1ULL), 65536ULL) * 1024 * 1024 / sizeof(TT_Entry);
-                transposition_table.clear();
-                transposition_table.resize(num_tt_entries);
+                cin >> num_tt_buckets;
+                num_tt_buckets = min(max(num_tt_buckets, 1ULL), 65536ULL) * 1024 * 1024 / sizeof(TT_Bucket);
+                tt_resize();
+            } else if (word == "PawnHash") {
+                cin >> word;
+                cin >> num_pawn_entries;
+                num_pawn_entries = min(max(num_pawn_entries, 1ULL), 1024ULL) * 1024 * 1024 / sizeof(PawnEntry);
+            } else if (word == "PollNodes") {
+                cin >> word;
+                cin >> poll_nodes;
+                poll_nodes = max(1, min(1 << 20, poll_nodes));
+            } else if (word == "MultiPV") {
+                cin >> word;
+                cin >> multipv;
+                multipv = max(1, min(256, multipv));
+            } else if (word == "HashFile") {
+                cin >> word >> ws;
+                getline(cin, tt_file);
+            } else if (word == "SaveHash") {
+                cout << "info string " << (tt_save_file(tt_file) ? "saved hash to " : "failed to save hash to ")
+                     << tt_file << endl;
+            } else if (word == "LoadHash") {
+                cout << "info string " << (tt_load_file(tt_file) ? "loaded hash from " : "failed to load hash from ")
+                     << tt_file << endl;
             }
         }
         // minify disable filter delete
         else if (word == "go") {
-            int wtime;
-            int btime;
-            cin >> word >> wtime >> word >> btime;
             // minify enable filter delete
-            if (word == "wtime") {
-                swap(wtime, btime);
+            int wtime = 0;
+            int btime = 0;
+            int winc = 0;
+            int binc = 0;
+            int movestogo = 0;
+            int movetime = 0;
+            // A clock at 0 still has to be played to, so remember which of them go actually gave
+            bool has_wtime = false;
+            bool has_btime = false;
+            bool has_movetime = false;
+            SearchLimits search_limits;
+            bool hold = false;
+            root_moves.clear();
+
+            string line;
+            getline(cin, line);
+            stringstream ss{line};
+            if (ss >> word && word == "perft") {
+                perft_divide(pos, ss);
+                continue;
             }
-            // minify disable filter delete
-
-            const auto start = now();
-            const auto allocated_time = (pos.flipped ? btime : wtime) / 3;
-
-            // Lazy SMP
-            vector<thread> threads;
-            vector<int> stops(thread_count, false);
-            for (int i = 1; i < thread_count; ++i) {
-                threads.emplace_back([=, &stops]() mutable {
-                    iteratively_deepen(pos,
-                                       hash_history,
-                                       // minify enable filter delete
-                                       i,
-                                       false,
-                                       // minify disable filter delete
-                                       start,
-                                       1 << 30,
-                                       stops[i]);
-                });
+            ss = stringstream{line};
+            while (ss >> word) {
+                if (word == "wtime") {
+                    has_wtime = static_cast<bool>(ss >> wtime);
+                } else if (word == "btime") {
+                    has_btime = static_cast<bool>(ss >> btime);
+                } else if (word == "winc") {
+                    ss >> winc;
+                } else if (word == "binc") {
+                    ss >> binc;
+                } else if (word == "movestogo") {
+                    ss >> movestogo;
+                } else if (word == "movetime") {
+                    has_movetime = static_cast<bool>(ss >> movetime);
+                } else if (word == "depth") {
+                    ss >> search_limits.depth;
+                    search_limits.depth = max(1, min(127, search_limits.depth));
+                } else if (word == "nodes") {
+                    ss >> search_limits.nodes;
+                } else if (word == "infinite" || word == "ponder") {
+                    hold = true;
+                } else if (word == "searchmoves") {
+                    Move legal_moves[256];
+                    const int num_moves = movegen(pos, legal_moves, false);
+                    while (ss >> word) {
+                        for (int i = 0; i < num_moves; ++i) {
+                            if (word == move_str(legal_moves[i], pos.flipped)) {
+                                root_moves.emplace_back(legal_moves[i]);
+                            }
+                        }
+                    }
+                }
             }
-            const auto best_move = iteratively_deepen(pos,
-                                                      hash_history,
-                                                      // minify enable filter delete
-                                                      0,
-                                                      false,
-                                                      // minify disable filter delete
-                                                      start,
-                                                      allocated_time,
-                                                      stops[0]);
-            for (int i = 1; i < thread_count; ++i) {
-                stops[i] = true;
+
+            const int time_left = pos.flipped ? btime : wtime;
+            const int inc = pos.flipped ? binc : winc;
+            if (has_movetime) {
+                search_limits.hard_time = search_limits.soft_time = max(1, movetime);
+            } else if (pos.flipped ? has_btime : has_wtime) {
+                // Aim for an even share of the clock plus most of the increment, but never use more than a third of
+                // what's left beyond the increment, and keep a little back for overhead
+                const int moves_left = movestogo ? min(movestogo, 30) : 30;
+                search_limits.hard_time = max(1, min(time_left / 3 + inc, time_left - 50));
+                search_limits.soft_time = min(search_limits.hard_time, time_left / moves_left + inc * 3 / 4);
+            } else if (search_limits.depth == 127 && search_limits.nodes == INT64_MAX) {
+                // Nothing to stop at, so search until told to
+                hold = true;
             }
-            for (int i = 1; i < thread_count; ++i) {
-                threads[i - 1].join();
+
+            // A ponder search runs without a clock until ponderhit brings the timed limits in
+            ponder_limits = search_limits;
+            if (hold) {
+                search_limits.hard_time = search_limits.soft_time = 1 << 30;
             }
+            start_search(pos, hash_history, search_limits, hold);
+            // minify disable filter delete
+            // 4ku-mini searches right here, on the UCI thread, and only reads wtime and btime
+            // minify insert int wtime;
+            // minify insert int btime;
+            // minify insert cin >> word >> wtime >> word >> btime;
+
+            // minify insert const auto start = now();
+            // minify insert const auto allocated_time = (pos.flipped ? btime : wtime) / 3;
 
-            cout << "bestmove " << move_str(best_move, pos.flipped) << endl;
+            // Lazy SMP
+            // minify insert vector<thread> threads;
+            // minify insert vector<int> stops(thread_count, false);
+            // minify insert for (int i = 1; i < thread_count; ++i) {
+                // minify insert threads.emplace_back([=, &stops]() mutable {
+                    // minify insert iteratively_deepen(pos, hash_history, start, 1 << 30, stops[i]);
+                // minify insert });
+            // minify insert }
+            // minify insert const auto best_move = iteratively_deepen(pos, hash_history, start, allocated_time, stops[0]);
+            // minify insert for (int i = 1; i < thread_count; ++i) {
+                // minify insert stops[i] = true;
+            // minify insert }
+            // minify insert for (int i = 1; i < thread_count; ++i) {
+                // minify insert threads[i - 1].join();
+            // minify insert }
+
+            // minify insert cout << "bestmove " << move_str(best_move, pos.flipped) << endl;
         } else if (word == "position") {
             // Set to startpos
             pos = Position();
@@ -1143,6 +3428,8 @@ int main(
 
             if (!fen.empty()) {
                 set_fen(pos, fen);
+            } else {
+                pos = refreshed(pos);
             }
             // minify disable filter delete
         } else {
@@ -1161,4 +3448,17 @@ int main(
             }
         }
     }
+
+    // minify enable filter delete
+    // Let the search and helper threads exit before they're destroyed
+    if (search_thread.joinable()) {
+        {
+            const lock_guard<mutex> lock(search_mutex);
+            search_quit = true;
+        }
+        search_cv.notify_all();
+        search_thread.join();
+    }
+    resize_threads(1);
+    // minify disable filter delete
 }
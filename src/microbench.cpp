@@ -0,0 +1,265 @@
+// Micro-benchmarks for the engine's building blocks, so each optimisation can be measured on its own instead of
+// through whole searches. Every primitive runs over the bench positions and their children, several times, and is
+// reported as ns/op with the spread between runs. With --perf the cycles, branch misses and cache misses per op are
+// read from perf_event_open as well, where the kernel allows it, and shown as - where it doesn't.
+//
+// 4ku is a single file, so it's included whole with its main() moved out of the way. Renamed, it loses the implicit
+// return 0 that only main gets, but it's never called.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wreturn-type"
+#define main engine_main
+#include "main.cpp"
+#undef main
+#pragma GCC diagnostic pop
+
+#include <cmath>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Results are folded in here and printed at the end, so the compiler can't drop the work
+u64 sink = 0;
+
+struct [[nodiscard]] Sample {
+    Position pos;
+    vector<Move> moves;
+};
+
+struct [[nodiscard]] PerfCounters {
+    array<int, 3> fds = {-1, -1, -1};
+    array<u64, 3> totals = {};
+};
+
+const char *const counter_names[] = {"cycles", "br-miss", "$-miss"};
+
+[[nodiscard]] PerfCounters open_counters() {
+    PerfCounters counters;
+#ifdef __linux__
+    const u64 configs[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+    for (int i = 0; i < 3; ++i) {
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters.fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+    return counters;
+}
+
+void start_counters([[maybe_unused]] PerfCounters &counters) {
+#ifdef __linux__
+    for (const int fd : counters.fds) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+void stop_counters([[maybe_unused]] PerfCounters &counters) {
+#ifdef __linux__
+    for (int i = 0; i < 3; ++i) {
+        if (counters.fds[i] >= 0) {
+            ioctl(counters.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+            u64 value = 0;
+            if (read(counters.fds[i], &value, sizeof(value)) == sizeof(value)) {
+                counters.totals[i] += value;
+            }
+        }
+    }
+#endif
+}
+
+void close_counters([[maybe_unused]] PerfCounters &counters) {
+#ifdef __linux__
+    for (int &fd : counters.fds) {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+#endif
+}
+
+// op() works on one sample and returns how many operations that was. The number of passes over the corpus is doubled
+// until a run takes at least 10 ms, then that many passes are timed once per run.
+template <typename F>
+void measure(const char *name, vector<Sample> &samples, const int runs, const bool use_perf, F op) {
+    const auto pass = [&]() {
+        int64_t ops = 0;
+        for (auto &sample : samples) {
+            ops += op(sample);
+        }
+        return ops;
+    };
+
+    int passes = 1;
+    while (true) {
+        const auto start = chrono::steady_clock::now();
+        for (int i = 0; i < passes; ++i) {
+            pass();
+        }
+        if (chrono::steady_clock::now() - start >= chrono::milliseconds(10)) {
+            break;
+        }
+        passes *= 2;
+    }
+
+    PerfCounters counters = use_perf ? open_counters() : PerfCounters();
+    vector<double> ns_per_op;
+    int64_t total_ops = 0;
+    for (int run = 0; run < runs; ++run) {
+        int64_t ops = 0;
+        start_counters(counters);
+        const auto start = chrono::steady_clock::now();
+        for (int i = 0; i < passes; ++i) {
+            ops += pass();
+        }
+        const auto elapsed = chrono::steady_clock::now() - start;
+        stop_counters(counters);
+        ns_per_op.push_back(static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(elapsed).count()) /
+                            static_cast<double>(ops));
+        total_ops += ops;
+    }
+    close_counters(counters);
+
+    double mean = 0.0;
+    for (const double ns : ns_per_op) {
+        mean += ns;
+    }
+    mean /= static_cast<double>(runs);
+    double variance = 0.0;
+    for (const double ns : ns_per_op) {
+        variance += (ns - mean) * (ns - mean);
+    }
+    variance /= static_cast<double>(max(1, runs - 1));
+
+    printf("%-18s %9.2f %9.2f %9.2f",
+           name,
+           mean,
+           sqrt(variance),
+           *min_element(ns_per_op.begin(), ns_per_op.end()));
+    if (use_perf) {
+        for (int i = 0; i < 3; ++i) {
+            if (counters.totals[i]) {
+                printf(" %9.2f", static_cast<double>(counters.totals[i]) / static_cast<double>(total_ops));
+            } else {
+                printf(" %9s", "-");
+            }
+        }
+    }
+    printf("\n");
+}
+
+int main(const int argc, const char **argv) {
+    int64_t num_runs = 10;
+    bool use_perf = false;
+    bool ok = true;
+    for (int i = 1; i < argc && ok; ++i) {
+        if (argv[i] == string("--perf")) {
+            use_perf = true;
+        } else if (argv[i] == string("--runs") && i + 1 < argc) {
+            ok = parse_arg(argv[++i], 2, 1000, num_runs);
+        } else {
+            ok = false;
+        }
+    }
+    if (!ok) {
+        cerr << "Usage: 4ku-microbench [--perf] [--runs 2-1000]" << endl;
+        return 1;
+    }
+    const int runs = static_cast<int>(num_runs);
+
+    // The bench positions and every position one move on from them
+    vector<Sample> samples;
+    for (const auto fen : bench_fens) {
+        Position pos;
+        set_fen(pos, fen);
+        Move moves[256];
+        const int num_moves = movegen(pos, moves, false);
+        samples.push_back({pos, vector<Move>(moves, moves + num_moves)});
+        for (int i = 0; i < num_moves; ++i) {
+            auto npos = pos;
+            makemove(npos, moves[i]);
+            Move child_moves[256];
+            const int num_child_moves = movegen(npos, child_moves, false);
+            samples.push_back({npos, vector<Move>(child_moves, child_moves + num_child_moves)});
+        }
+    }
+
+    printf("%zu positions, %d runs\n", samples.size(), runs);
+    printf("%-18s %9s %9s %9s", "primitive", "ns/op", "stddev", "min");
+    if (use_perf) {
+        for (const auto counter_name : counter_names) {
+            printf(" %9s", counter_name);
+        }
+    }
+    printf("\n");
+
+    measure("movegen", samples, runs, use_perf, [](Sample &sample) {
+        Move moves[256];
+        sink += static_cast<u64>(movegen(sample.pos, moves, false));
+        return 1;
+    });
+    measure("movegen captures", samples, runs, use_perf, [](Sample &sample) {
+        Move moves[256];
+        sink += static_cast<u64>(movegen(sample.pos, moves, true));
+        return 1;
+    });
+    // Each move is made on a copy, as in the search, so the copy is part of the cost
+    measure("makemove", samples, runs, use_perf, [](Sample &sample) {
+        for (const auto &move : sample.moves) {
+            auto npos = sample.pos;
+            makemove(npos, move);
+            sink += npos.hash[0];
+        }
+        return static_cast<int>(sample.moves.size());
+    });
+    measure("attacked", samples, runs, use_perf, [](Sample &sample) {
+        for (int sq = 0; sq < 64; ++sq) {
+            sink += attacked(sample.pos, sq);
+        }
+        return 64;
+    });
+    // The pawn hash table is warm after the first pass, as it mostly is in a search
+    measure("eval", samples, runs, use_perf, [](Sample &sample) {
+        sink += static_cast<u64>(eval(sample.pos));
+        return 1;
+    });
+    measure("get_hash", samples, runs, use_perf, [](Sample &sample) {
+        sink += get_hash(sample.pos, false);
+        return 1;
+    });
+    measure("bishop", samples, runs, use_perf, [](Sample &sample) {
+        const u64 blockers = sample.pos.colour[0] | sample.pos.colour[1];
+        for (int sq = 0; sq < 64; ++sq) {
+            sink += bishop(sq, blockers);
+        }
+        return 64;
+    });
+    measure("rook", samples, runs, use_perf, [](Sample &sample) {
+        const u64 blockers = sample.pos.colour[0] | sample.pos.colour[1];
+        for (int sq = 0; sq < 64; ++sq) {
+            sink += rook(sq, blockers);
+        }
+        return 64;
+    });
+    // Flipped twice so the sample ends up as it started
+    measure("flip", samples, runs, use_perf, [](Sample &sample) {
+        flip(sample.pos);
+        flip(sample.pos);
+        sink += sample.pos.colour[0];
+        return 2;
+    });
+
+    printf("checksum %llu\n", static_cast<unsigned long long>(sink));
+}